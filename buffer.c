@@ -6,30 +6,285 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "util/alloc.h"
 #include "range.h"
 #include "buffer.h"
 #include "util/list.h"
+#include "util/tree.h"
+#include "util/ptree.h"
 #include "util/io.h"
 #include "global.h"
 #include "util/str.h"
+#include "files.h"
+#include "undo.h"
+#include "journal.h"
+#include "recover.h"
 
-buffer_t *buffer_new_list(struct list *l)
+/*
+ * a buffer line - the index node, plus what we cache about its data
+ * lines live in the buffer's arena, and are recycled through b->spare
+ *
+ * t.l.data is one of: borrowed, pointing into what was read,
+ * inline, in inl[], for short lines that have been edited,
+ * shared, a str_share()d string also held by registers, so never changed,
+ * or malloc()ed, with room for cap bytes (or more, if cap is 0)
+ *
+ * dirty is set while b->snaplines has it as PT_DIRTY
+ */
+#define LINE_INLINE 14
+
+struct line
+{
+	struct tnode t; /* must be first */
+	int len; /* bytes in t.l.data, excluding the '\0' - may include '\0's */
+	int cap;
+	unsigned char borrowed;
+	unsigned char shared;
+	unsigned char stripped; /* a '\r' was taken off as it was read */
+	unsigned char dirty;
+	char inl[LINE_INLINE];
+};
+
+#define LINE(l) ((struct line *)(l))
+#define LINE_MALLOCED(ln) (!(ln)->borrowed && !(ln)->shared && (ln)->t.l.data != (ln)->inl)
+
+/*
+ * snapshots share b->snaplines, which snaplines_update() keeps up with the
+ * lines. shared lines are referenced, borrowed ones point into what was
+ * read, which is then kept (in a store) until the last snapshot goes - it
+ * can't be changed in place meanwhile, see buffer_line_delete() - and
+ * other lines are PT_DIRTY, until a snapshot takes a copy of them
+ */
+struct buffer_store
+{
+	unsigned int refs;
+	char *mem;
+	struct arena arena;
+};
+
+struct snapshot
+{
+	unsigned int refs;
+	struct buffer_store *store;
+	int eol, crlf;
+	int complete;
+	struct pnode *lines;
+};
+
+static void buffer_stoploading(buffer_t *);
+static char *buffer_line_room(buffer_t *, struct list *, int n);
+static void buffer_changed(buffer_t *);
+static void store_unref(struct buffer_store *);
+static void snaplines_update(buffer_t *, int y, int nold, int nnew, struct list *);
+
+static struct tnode *buffer_newline(buffer_t *b, void *d)
+{
+	struct line *ln;
+
+	if((ln = b->spare))
+		b->spare = LINE(ln->t.l.next);
+	else
+		ln = arena_alloc(b->arena, sizeof *ln);
+
+	memset(ln, '\0', sizeof *ln);
+	ln->t.l.data = d;
+	ln->len = strlen(d);
+	return &ln->t;
+}
+
+/* a malloc()ed copy of a line's data, '\0's and all */
+static char *line_dup(const struct line *ln)
+{
+	char *d = umalloc(ln->len + 1);
+	memcpy(d, ln->t.l.data, ln->len + 1);
+	return d;
+}
+
+/*
+ * recycle an extracted line
+ * if keep, its data is returned as malloc()ed memory, otherwise it's freed
+ */
+static void *buffer_releaseline(buffer_t *b, struct tnode *t, int keep)
+{
+	void *d = t->l.data;
+
+	if(!LINE_MALLOCED(LINE(t))){
+		d = keep ? line_dup(LINE(t)) : NULL;
+		if(LINE(t)->borrowed)
+			b->nborrowed--;
+		if(LINE(t)->shared)
+			str_unref(t->l.data);
+	}else if(!keep){
+		free(d);
+		d = NULL;
+	}
+	b->nchars -= LINE(t)->len;
+
+	t->l.next = (struct list *)b->spare;
+	b->spare = LINE(t);
+
+	return d;
+}
+
+static void buffer_freelines(buffer_t *b)
+{
+	if(b->loading)
+		buffer_stoploading(b);
+
+	/* only lines that have been edited need free()ing */
+	if(b->nborrowed < buffer_nlines(b)){
+		struct list *l;
+
+		for(l = b->lines; l; l = l->next)
+			if(LINE_MALLOCED(LINE(l)))
+				free(l->data);
+			else if(LINE(l)->shared)
+				str_unref(l->data);
+	}
+
+	if(b->store){
+		/* snapshots still point into what was read */
+		b->store->mem = b->mem;
+		arena_merge(&b->store->arena, b->arena);
+		store_unref(b->store);
+		b->store = NULL;
+	}else{
+		arena_free(b->arena);
+		free(b->mem);
+	}
+	b->mem = NULL;
+
+	b->lines = NULL;
+	b->index = NULL;
+	b->spare = NULL;
+	b->nchars = b->nborrowed = 0;
+}
+
+/* move a plain list's data into a chain of index nodes, freeing the plain nodes */
+static struct tnode *buffer_adopt(buffer_t *b, struct list *l)
+{
+	struct tnode *chain = NULL, *last = NULL;
+	struct list *next;
+
+	for(l = list_gethead(l); l; l = next){
+		next = l->next;
+
+		if(l->data){
+			struct tnode *t = buffer_newline(b, l->data);
+
+			if(last)
+				last->l.next = &t->l;
+			else
+				chain = t;
+			last = t;
+		}
+
+		free(l);
+	}
+
+	return chain;
+}
+
+/* a chain of index nodes sharing a list's str_share()d data, which is left as it is */
+static struct tnode *buffer_adopt_shared(buffer_t *b, struct list *l)
+{
+	struct tnode *chain = NULL, *last = NULL;
+
+	for(l = list_gethead(l); l; l = l->next){
+		struct tnode *t;
+
+		if(!l->data)
+			continue;
+
+		t = buffer_newline(b, str_ref(l->data));
+		LINE(t)->shared = 1;
+		LINE(t)->len = str_share_len(l->data);
+
+		if(last)
+			last->l.next = &t->l;
+		else
+			chain = t;
+		last = t;
+	}
+
+	return chain;
+}
+
+/* l's data, made shared if it isn't already, with a reference for the caller */
+static char *buffer_line_share(buffer_t *b, struct list *l)
+{
+	struct line *ln = LINE(l);
+
+	if(!ln->shared){
+		char *d = str_share(l->data, ln->len);
+
+		if(LINE_MALLOCED(ln))
+			free(l->data);
+		else if(ln->borrowed){
+			ln->borrowed = 0;
+			b->nborrowed--;
+		}
+		l->data = d;
+		ln->shared = 1;
+		ln->cap = 0;
+	}
+
+	return str_ref(l->data);
+}
+
+/* link chain in at index i, keeping at least one line in the buffer */
+static void buffer_splice(buffer_t *b, int i, struct tnode *chain)
+{
+	struct tnode *t;
+
+	buffer_changed(b);
+
+	for(t = chain; t; t = (struct tnode *)t->l.next)
+		b->nchars += LINE(t)->len;
+
+	tree_insert(&b->index, i, chain);
+
+	if(!b->index){
+		char *s = umalloc(sizeof(char));
+		*s = '\0';
+		t = buffer_newline(b, s);
+		tree_insert(&b->index, 0, t);
+	}
+
+	b->lines = &tree_first(b->index)->l;
+}
+
+/* a buffer with no lines yet - the caller must buffer_splice() */
+static buffer_t *buffer_alloc(void)
 {
 	buffer_t *b = umalloc(sizeof(*b));
 	memset(b, '\0', sizeof(*b));
 
-	b->lines = l;
+	b->arena = umalloc(sizeof *b->arena);
+	memset(b->arena, '\0', sizeof *b->arena);
 
-	b->nlines = b->eol = 1;
+	b->eol = 1;
 	b->opentime = time(NULL);
 
 	return b;
 }
 
+buffer_t *buffer_new_list(struct list *l)
+{
+	buffer_t *b = buffer_alloc();
+
+	buffer_splice(b, 0, buffer_adopt(b, l));
+	snaplines_update(b, 0, 0, buffer_nlines(b), NULL);
+
+	return b;
+}
+
 buffer_t *buffer_new(char *p)
 {
 	return buffer_new_list(list_new(p));
@@ -53,215 +308,1561 @@ void buffer_setfilename(buffer_t *b, const char *s)
 		b->fname = NULL;
 }
 
-int is_crlf(buffer_t *b)
+/*
+ * loading - the file is read into one block, which is then split
+ * into lines in place, each '\n' becoming a '\0'
+ *
+ * big files are read and split by several threads, each taking the
+ * lines that start in its share of the block, into an arena of its own
+ */
+#define LOAD_SHARE_MIN   (16 * 1024 * 1024)
+#define LOAD_THREADS_MAX 8
+
+struct loader
 {
-	struct list *l;
+	int fd;
+	off_t off; /* file offset of start, for loader_read() */
+	char *start, *end;
+	int err;
 
-	for(l = b->lines; l && l->data; l = l->next){
-		char *s = l->data;
+	struct arena arena;
+	struct tnode *chain, *last;
+	int nlines, ncr; /* ncr: lines ending in '\r' */
+};
 
-		if(!*s)
-			return 0;
+static int loader_nthreads(size_t len)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n = len / LOAD_SHARE_MIN;
 
-		if(s[strlen(s)-1] != '\r'){
-			if(l->next)
-				return 0;
-			else
-				/* all crlf except last line, unless only one line */
-				return !!l->prev;
+	if(n > (size_t)ncpu)
+		n = ncpu;
+	if(n > LOAD_THREADS_MAX)
+		n = LOAD_THREADS_MAX;
+
+	return n > 1 ? n : 1;
+}
+
+/* f on each loader - if a thread can't be started, its share is done here */
+static void loader_run(struct loader *ld, int n, void *(*f)(void *))
+{
+	pthread_t tid[LOAD_THREADS_MAX];
+	int i, nstarted;
+
+	for(i = 1; i < n; i++)
+		if(pthread_create(&tid[i], NULL, f, &ld[i]))
+			break;
+	nstarted = i;
+
+	for(; i < n; i++)
+		f(&ld[i]);
+	f(&ld[0]);
+
+	for(i = 1; i < nstarted; i++)
+		pthread_join(tid[i], NULL);
+}
+
+static void *loader_read(void *arg)
+{
+	struct loader *ld = arg;
+	char *p = ld->start;
+	ssize_t n;
+
+	for(; p < ld->end; p += n)
+		if((n = pread(ld->fd, p, ld->end - p, ld->off + (p - ld->start))) <= 0){
+			ld->err = 1;
+			break;
 		}
-	}
 
-	/* all are crlf */
-	return 1;
+	return NULL;
 }
 
-int buffer_read(buffer_t **buffer, FILE *f)
+static void *loader_split(void *arg)
 {
-	struct list *l;
-	buffer_t *b;
-	int eol;
+	struct loader *ld = arg;
+	char *p = ld->start;
 
-	l = list_from_file(f, &eol);
-	if(!l){
-		*buffer = NULL;
-		return -1;
+	while(p < ld->end){
+		char *nl = memchr(p, '\n', ld->end - p);
+		struct line *ln = arena_alloc(&ld->arena, sizeof *ln);
+
+		if(!nl)
+			nl = ld->end; /* the end of the block, already '\0' */
+		*nl = '\0';
+
+		memset(ln, '\0', sizeof *ln);
+		ln->t.l.data = p;
+		ln->len = nl - p;
+		ln->borrowed = 1;
+
+		if(nl > p && nl[-1] == '\r')
+			ld->ncr++;
+
+		if(ld->last)
+			ld->last->l.next = &ln->t.l;
+		else
+			ld->chain = &ln->t;
+		ld->last = &ln->t;
+		ld->nlines++;
+
+		p = nl + 1;
 	}
 
-	b = buffer_new_list(l);
+	return NULL;
+}
 
-	b->eol = eol;
-	b->touched_fs = 1;
+/* split mem into a chain of lines, in res */
+static void buffer_split(buffer_t *b, char *mem, size_t len, struct loader *res)
+{
+	struct loader ld[LOAD_THREADS_MAX];
+	char *p = mem, *const end = mem + len;
+	int i, n = loader_nthreads(len);
 
-	b->dirty = 1;
-	if(buffer_nlines(b) == 0){
-		/* create a line */
-		char *s = umalloc(sizeof(char));
+	for(i = 0; i < n; i++){
+		char *split = end;
 
-		*s = '\0';
-		list_append(b->lines, s);
+		if(i < n - 1 && (split = mem + len / n * (i + 1)) > p){
+			/* move up to the start of a line */
+			char *nl = memchr(split - 1, '\n', end - split + 1);
+			split = nl ? nl + 1 : end;
+		}else if(split < p){
+			split = p;
+		}
 
-		b->nlines = 1;
+		memset(&ld[i], '\0', sizeof ld[i]);
+		ld[i].start = p;
+		ld[i].end = p = split;
 	}
 
-	if((b->crlf = is_crlf(b))){
-		struct list *l;
-		for(l = b->lines; l && l->data; l = l->next){
-			char *s = l->data;
-			const int i = strlen(s) - 1;
+	loader_run(ld, n, loader_split);
 
-			if(s[i] == '\r')
-				s[i] = '\0';
+	memset(res, '\0', sizeof *res);
+	for(i = 0; i < n; i++){
+		if(ld[i].chain){
+			if(res->last)
+				res->last->l.next = &ld[i].chain->l;
+			else
+				res->chain = ld[i].chain;
+			res->last = ld[i].last;
 		}
+		res->nlines += ld[i].nlines;
+		res->ncr += ld[i].ncr;
+		arena_merge(b->arena, &ld[i].arena);
 	}
+	b->nborrowed += res->nlines;
+}
 
-	*buffer = b;
+/*
+ * whether res's lines (following lines already read, unless first) are crlf
+ * the file's last line needn't end in '\r', unless it's the only one
+ */
+static int loader_crlf(const struct loader *res, int first, int eof)
+{
+	const struct tnode *last = res->last;
 
-	return buffer_nchars(b);
-#undef b
+	if(res->ncr == res->nlines)
+		return res->nlines > 0 || !first;
+
+	if(!eof || res->ncr != res->nlines - 1 || !LINE(last)->len
+	|| ((char *)last->l.data)[LINE(last)->len - 1] == '\r')
+		return 0;
+
+	return res->nlines > 1 || !first;
 }
 
-/* returns bytes written */
-int buffer_write(buffer_t *b)
+static void loader_stripcr(struct tnode *chain)
+{
+	struct tnode *t;
+
+	for(t = chain; t; t = (struct tnode *)t->l.next){
+		char *s = t->l.data;
+		const int x = LINE(t)->len - 1;
+
+		if(x >= 0 && s[x] == '\r'){
+			s[x] = '\0';
+			LINE(t)->len--;
+			LINE(t)->stripped = 1;
+		}
+	}
+}
+
+/*
+ * interning - with the intern setting, identical lines share one
+ * str_share()d copy, so the block they were read into can be freed
+ */
+struct intern
+{
+	struct interned
+	{
+		char *s; /* a reference, so lines can come and go */
+		int len;
+		unsigned long long hash;
+	} *tab;
+	size_t size, n; /* size is a power of two */
+	size_t counted; /* of tab's size, in a buffer's interned */
+};
+
+static struct intern *intern_new(void)
 {
-	return buffer_write_list(b, list_gethead(b->lines));
+	struct intern *in = umalloc(sizeof *in);
+	memset(in, '\0', sizeof *in);
+	return in;
 }
 
-int buffer_write_list(buffer_t *b, struct list *l)
+static void intern_free(struct intern *in)
 {
-	const char *crlf;
-	FILE *f = fopen(b->fname, "w");
-	int eno;
-	long nwrite = 0, w;
+	size_t i;
 
-	if(!f)
-		return -1;
+	for(i = 0; i < in->size; i++)
+		str_unref(in->tab[i].s);
+	free(in->tab);
+	free(in);
+}
 
-	if(b->crlf)
-		crlf = "\r";
-	else
-		crlf = "";
+static void intern_grow(struct intern *in)
+{
+	struct interned *old = in->tab;
+	const size_t oldsize = in->size;
+	size_t i;
 
-	while(l->next){
-		if((w = fprintf(f, "%s%s\n", (char *)l->data, crlf)) < 0){
-			nwrite = -1;
-			goto bail;
+	in->size = oldsize ? 2 * oldsize : 1024;
+	in->tab = umalloc(in->size * sizeof *in->tab);
+	memset(in->tab, '\0', in->size * sizeof *in->tab);
+
+	for(i = 0; i < oldsize; i++)
+		if(old[i].s){
+			size_t j = old[i].hash & (in->size - 1);
+
+			while(in->tab[j].s)
+				j = (j + 1) & (in->size - 1);
+			in->tab[j] = old[i];
 		}
-		nwrite += w;
-		l = l->next;
-	}
 
-	/*
-	 * l is now the last item in the list
-	 * (possibly the first)
-	 */
+	free(old);
+}
 
-	w = fprintf(f, "%s%s%s", (char *)l->data, b->eol ? crlf : "", b->eol ? "\n" : "");
-	if(w < 0)
-		nwrite = -1;
-	else
-		nwrite += w;
+/* a reference to the shared copy of s - *hit if there was one already */
+static char *intern_get(struct intern *in, const char *s, int len, int *hit)
+{
+	const unsigned long long h = str_hash(STR_HASH_INIT, s, len);
+	size_t i;
 
-	b->opentime = time(NULL);
-	b->touched_fs = 1;
+	if(2 * (in->n + 1) > in->size)
+		intern_grow(in);
 
-	if(global_settings.fsync && (fflush(f) || fsync(fileno(f)))){
-		nwrite = -1;
-		goto bail;
-	}
+	for(i = h & (in->size - 1); in->tab[i].s; i = (i + 1) & (in->size - 1))
+		if(in->tab[i].hash == h && in->tab[i].len == len && !memcmp(in->tab[i].s, s, len)){
+			*hit = 1;
+			return str_ref(in->tab[i].s);
+		}
 
-bail:
-	eno = errno;
-	if(fclose(f))
-		nwrite = -1;
-	else
-		errno = eno;
+	in->tab[i].s    = str_share(s, len);
+	in->tab[i].len  = len;
+	in->tab[i].hash = h;
+	in->n++;
 
-	return nwrite;
+	*hit = 0;
+	return str_ref(in->tab[i].s);
 }
 
-void buffer_free_nolist(buffer_t *b)
+/* chain's lines are borrowed, and are about to lose what they point into */
+static void buffer_intern(buffer_t *b, struct intern *in, struct tnode *chain)
 {
-	if(b){
-		free(b->fname);
-		free(b);
+	struct tnode *t;
+
+	for(t = chain; t; t = (struct tnode *)t->l.next){
+		struct line *ln = LINE(t);
+		int hit;
+
+		t->l.data = intern_get(in, t->l.data, ln->len, &hit);
+		ln->borrowed = 0;
+		ln->shared = 1;
+		b->nborrowed--;
+
+		/* the line's gone from the block, '\r' and all, but a first one's copied */
+		b->interned += ln->len + 1 + !!ln->stripped;
+		if(!hit)
+			b->interned -= str_share_size(ln->len);
 	}
+
+	b->interned -= in->size * sizeof *in->tab - in->counted;
+	in->counted = in->size * sizeof *in->tab;
 }
 
-void buffer_free(buffer_t *b)
+/*
+ * all of f, read into one block, with room for a '\0' after it
+ *
+ * this isn't mmap()ed - truncating a file takes even the private pages
+ * of a mapping with it, and the buffer must outlive the file's contents
+ */
+static char *buffer_slurp(FILE *f, size_t *plen)
 {
-	if(b){
-		list_free(b->lines, free);
-		buffer_free_nolist(b);
+	struct stat st;
+	size_t len = 0, siz = BUFSIZ, n;
+	char *mem;
+	int fd = fileno(f);
+
+	if(fd == -1 || fstat(fd, &st) == -1)
+		return NULL;
+
+	if(S_ISREG(st.st_mode) && st.st_size > 0){
+		const int nthreads = loader_nthreads(st.st_size);
+
+		siz = st.st_size + 1; /* one read, which comes up short at EOF */
+		mem = umalloc(siz);
+
+		if(nthreads > 1){
+			struct loader ld[LOAD_THREADS_MAX];
+			int i, err = 0;
+
+			for(i = 0; i < nthreads; i++){
+				memset(&ld[i], '\0', sizeof ld[i]);
+				ld[i].fd = fd;
+				ld[i].off = st.st_size / nthreads * i;
+				ld[i].start = mem + ld[i].off;
+				ld[i].end = i < nthreads - 1
+					? mem + st.st_size / nthreads * (i + 1)
+					: mem + st.st_size;
+			}
+
+			loader_run(ld, nthreads, loader_read);
+
+			for(i = 0; i < nthreads; i++)
+				err |= ld[i].err;
+
+			if(!err){
+				mem[st.st_size] = '\0';
+				*plen = st.st_size;
+				return mem;
+			}
+			/* changed under us? read it normally */
+		}
+	}else{
+		mem = umalloc(siz);
+	}
+
+	while((n = fread(mem + len, 1, siz - len, f)) == siz - len){
+		len = siz;
+		mem = urealloc(mem, siz *= 2);
+	}
+	len += n;
+
+	if(ferror(f)){
+		free(mem);
+		return NULL;
 	}
+
+	mem[len] = '\0';
+	*plen = len;
+	return mem;
 }
 
-void buffer_replace(buffer_t *b, struct list *l)
+/*
+ * line indexes - the length of each of a file's lines, kept in
+ * ~/.uviindex so a big file needn't be scanned for newlines next time
+ *
+ * an index is keyed by the file's device and inode, and is only used
+ * while the file's size and mtime match. a new one is written aside
+ * and renamed into place, so a mapping of the old one stays whole
+ */
+#define INDEX_MAGIC "uvi\001"
+
+struct lineindex
+{
+	char magic[4];
+	int crlf;
+	unsigned long long dev, ino, size, nlines;
+	long long mtime;
+	/* unsigned int lens[nlines]; each including its '\n' */
+};
+
+static int index_wanted(const struct stat *st)
 {
-	list_free(b->lines, free);
-	b->lines = l;
-	b->dirty = 1;
+	return global_settings.index && S_ISREG(st->st_mode)
+		&& st->st_size >= (off_t)global_settings.index * 1024 * 1024;
 }
 
-int buffer_nchars(buffer_t *b)
+/* the mapped index for st, or NULL - index_unmap() it when done */
+static const struct lineindex *index_map(const struct stat *st)
 {
-	struct list *l = list_gethead(b->lines);
-	int chars = 0;
+	const struct lineindex *idx;
+	struct stat ist;
+	int fd;
 
-	if(!l->data)
-		return 1;
+	if((fd = open(file_index(st->st_dev, st->st_ino), O_RDONLY)) == -1)
+		return NULL;
 
-	while(l){
-		chars += strlen(l->data);
-		l = l->next;
+	if(fstat(fd, &ist) == -1 || (size_t)ist.st_size < sizeof *idx
+	|| (idx = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		close(fd);
+		return NULL;
 	}
+	close(fd);
 
-	return chars;
+	if(memcmp(idx->magic, INDEX_MAGIC, sizeof idx->magic)
+	|| idx->dev != (unsigned long long)st->st_dev
+	|| idx->ino != (unsigned long long)st->st_ino
+	|| idx->size != (unsigned long long)st->st_size
+	|| idx->mtime != (long long)st->st_mtime
+	|| (size_t)ist.st_size != sizeof *idx + idx->nlines * sizeof(unsigned int)){
+		munmap((void *)idx, ist.st_size);
+		return NULL;
+	}
+
+	return idx;
 }
 
-int buffer_nlines(buffer_t *b)
+static void index_unmap(const struct lineindex *idx)
+{
+	munmap((void *)idx, sizeof *idx + idx->nlines * sizeof(unsigned int));
+}
+
+#define INDEX_LENS(idx) ((const unsigned int *)((idx) + 1))
+
+/*
+ * split mem into n lines of the given lengths
+ * returns 0 if they don't line up with mem's newlines
+ */
+static int index_split(buffer_t *b, char *mem, size_t len,
+		const unsigned int *lens, size_t n, int crlf, struct loader *res)
 {
-	if(b->dirty){
-		b->nlines = list_count(b->lines);
-		b->dirty = 0;
+	char *p, *const end = mem + len;
+	size_t i;
+
+	memset(res, '\0', sizeof *res);
+
+	/* check first, so a stale index leaves mem as it was */
+	for(p = mem, i = 0; i < n; p += lens[i++])
+		if(!lens[i] || lens[i] > (size_t)(end - p)
+		|| (lens[i] < (size_t)(end - p) && p[lens[i] - 1] != '\n'))
+			return 0;
+	if(p != end)
+		return 0;
+
+	for(p = mem, i = 0; i < n; p += lens[i++]){
+		struct line *ln;
+		char *nl = p + lens[i];
+
+		if(nl[-1] == '\n')
+			nl--;
+		if(crlf && nl > p && nl[-1] == '\r')
+			nl--;
+		*nl = '\0';
+
+		ln = arena_alloc(b->arena, sizeof *ln);
+		memset(ln, '\0', sizeof *ln);
+		ln->t.l.data = p;
+		ln->len = nl - p;
+		ln->borrowed = 1;
+
+		if(res->last)
+			res->last->l.next = &ln->t.l;
+		else
+			res->chain = &ln->t;
+		res->last = &ln->t;
 	}
 
-	return b->nlines;
+	res->nlines = n;
+	b->nborrowed += n;
+	return 1;
 }
 
-
-void buffer_remove_range(buffer_t *buffer, struct range *rng)
+/* append the lengths of res's lines, which end at end, before any '\r' stripping */
+static void index_addlens(const struct loader *res, const char *end,
+		unsigned int **lens, size_t *n)
 {
-	list_free(buffer_extract_range(buffer, rng), free);
+	const struct tnode *t;
+	size_t i = *n;
+
+	*lens = urealloc(*lens, (*n += res->nlines) * sizeof **lens);
+
+	for(t = res->chain; t; t = (const struct tnode *)t->l.next){
+		const char *next = t->l.next ? t->l.next->data : end;
+		(*lens)[i++] = next - (const char *)t->l.data;
+	}
 }
 
+static void index_save(const struct stat *st, int crlf,
+		const unsigned int *lens, size_t n)
+{
+	struct lineindex idx;
+	char tmp[sizeof "/.12345678901234567890"], *path;
+	FILE *f;
+	int ok;
+
+	path = umalloc(strlen(file_index(st->st_dev, st->st_ino)) + sizeof tmp);
+	strcpy(path, file_index(st->st_dev, st->st_ino));
 
-struct list *buffer_extract_range(buffer_t *buffer, struct range *rng)
+	*strrchr(path, '/') = '\0';
+	mkdir(path, 0700); /* may well exist */
+
+	snprintf(tmp, sizeof tmp, "/.%ld", (long)getpid());
+	strcat(path, tmp);
+
+	memset(&idx, '\0', sizeof idx);
+	memcpy(idx.magic, INDEX_MAGIC, sizeof idx.magic);
+	idx.crlf   = crlf;
+	idx.dev    = st->st_dev;
+	idx.ino    = st->st_ino;
+	idx.size   = st->st_size;
+	idx.nlines = n;
+	idx.mtime  = st->st_mtime;
+
+	if((f = fopen(path, "w"))){
+		ok = fwrite(&idx, sizeof idx, 1, f) == 1
+			&& fwrite(lens, sizeof *lens, n, f) == n;
+
+		if(fclose(f) == 0 && ok)
+			rename(path, file_index(st->st_dev, st->st_ino));
+		else
+			remove(path);
+	}
+
+	free(path);
+}
+
+int buffer_read(buffer_t **buffer, FILE *f)
 {
-	struct list *l, *newpos, *extracted;
+	const struct lineindex *idx;
+	struct loader res;
+	struct stat st;
+	buffer_t *b;
+	char *mem;
+	size_t len;
+	int indexed, split = 0;
+
+	mem = buffer_slurp(f, &len);
+	if(!mem){
+		*buffer = NULL;
+		return -1;
+	}
+
+	b = buffer_alloc();
 
-	l = list_getindex(buffer->lines, rng->start);
+	/* an empty file has no lines to end */
+	b->eol = len == 0 || mem[len - 1] == '\n';
+	b->touched_fs = 1;
+
+	/* lines point into mem, so it's kept until the buffer is freed */
+	b->mem = mem;
+
+	indexed = fstat(fileno(f), &st) == 0 && index_wanted(&st)
+		&& (size_t)st.st_size == len;
+
+	if(indexed && (idx = index_map(&st))){
+		if((split = index_split(b, mem, len, INDEX_LENS(idx), idx->nlines, idx->crlf, &res)))
+			b->crlf = idx->crlf;
+		index_unmap(idx);
+	}
+
+	if(!split){
+		buffer_split(b, mem, len, &res);
+		b->crlf = loader_crlf(&res, 1, 1);
 
-	extracted = list_extract_range(&l, rng->end - rng->start + 1);
-	newpos = l;
+		if(indexed){
+			unsigned int *lens = NULL;
+			size_t n = 0;
+
+			index_addlens(&res, mem + len, &lens, &n);
+			index_save(&st, b->crlf, lens, n);
+			free(lens);
+		}
 
-	/* l must be used below, since buffer->lines is now invalid */
+		if(b->crlf)
+			loader_stripcr(res.chain);
+	}
 
-	if(!(l = list_getindex(newpos, rng->start)))
-		/* removed lines, and curline was in the range rng */
-		l = list_gettail(newpos);
+	if(global_settings.intern){
+		struct intern *in = intern_new();
 
-	buffer->lines = l = list_gethead(l);
+		buffer_intern(b, in, res.chain);
+		intern_free(in);
 
-	if(!l->data){
-		/* just deleted everything, make empty line */
-		l->data = umalloc(sizeof(char));
-		*(char *)l->data = '\0';
+		free(b->mem);
+		b->mem = NULL;
 	}
 
-	buffer->dirty = 1;
+	buffer_splice(b, 0, res.chain);
+	snaplines_update(b, 0, 0, buffer_nlines(b), NULL);
+
+	*buffer = b;
+
+	return buffer_nchars(b);
+}
 
-	return extracted;
+/*
+ * lazy loading - the file is read a block at a time, into the arena,
+ * with a partial line at the end of a block carried into the next
+ */
+#define LOAD_BLOCK (1024 * 1024)
+
+struct loading
+{
+	int fd;
+	struct stat st;
+	off_t off;
+	char *carry;
+	size_t ncarry;
+	int lastc; /* the last byte read, for eol */
+
+	const struct lineindex *idx; /* lines come from here, if we have one */
+	size_t iline;
+
+	int index; /* otherwise, whether we're keeping lens[] for a new one */
+	unsigned int *lens;
+	size_t nlens;
+
+	/* if interning, blocks are malloc()ed and freed once split, and carry with them */
+	struct intern *intern;
+};
+
+static void buffer_stoploading(buffer_t *b)
+{
+	struct loading *ld = b->loading;
+
+	if(ld->idx)
+		index_unmap(ld->idx);
+	if(ld->intern){
+		intern_free(ld->intern);
+		free(ld->carry);
+	}
+	free(ld->lens);
+	close(ld->fd);
+	free(ld);
+	b->loading = NULL;
+}
+
+/* lines loaded are new to snapshots, like any others */
+static void buffer_addloaded(buffer_t *b, struct tnode *chain)
+{
+	const int n = buffer_nlines(b);
+
+	buffer_splice(b, n, chain);
+	snaplines_update(b, n, 0, buffer_nlines(b) - n, NULL);
+}
+
+/* the index has the line lengths, so blocks are read a whole number of lines at a time */
+static int buffer_loadindexed(buffer_t *b, int all)
+{
+	struct loading *ld = b->loading;
+	const unsigned int *lens = INDEX_LENS(ld->idx) + ld->iline;
+	struct loader res;
+	size_t want = 0, len, i;
+	ssize_t n = 0;
+	char *mem;
+
+	for(i = 0; ld->iline + i < ld->idx->nlines && (all || want < LOAD_BLOCK); i++)
+		want += lens[i];
+
+	mem = ld->intern ? umalloc(want + 1) : arena_alloc(b->arena, want + 1);
+
+	for(len = 0; len < want; len += n)
+		if((n = pread(ld->fd, mem + len, want - len, ld->off + len)) <= 0)
+			break;
+	mem[len] = '\0';
+	if(len)
+		ld->lastc = mem[len - 1];
+
+	if(len < want || !index_split(b, mem, len, lens, i, b->crlf, &res)){
+		/* changed under us - scan from here on */
+		index_unmap(ld->idx);
+		ld->idx = NULL;
+		if(ld->intern)
+			free(mem);
+		return 1;
+	}
+
+	ld->off += len;
+	ld->iline += i;
+
+	if(ld->intern){
+		buffer_intern(b, ld->intern, res.chain);
+		free(mem);
+	}
+
+	if(res.chain || ld->iline == ld->idx->nlines)
+		buffer_addloaded(b, res.chain);
+
+	if(ld->iline == ld->idx->nlines){
+		b->eol = ld->off == 0 || ld->lastc == '\n';
+		buffer_stoploading(b);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * the '\r's were stripped, but it turns out the file isn't crlf - they go
+ * back on the lines they came off, not on lines added since
+ */
+static void buffer_uncrlf(buffer_t *b)
+{
+	struct list *l;
+
+	buffer_changed(b);
+
+	for(l = b->lines; l; l = l->next){
+		struct line *ln = LINE(l);
+		char *s = l->data;
+
+		if(!ln->stripped)
+			continue;
+
+		if(!ln->borrowed || b->store)
+			s = buffer_line_room(b, l, 1);
+		/* else the '\r' was here, followed by the '\n' (now '\0') */
+
+		s[ln->len] = '\r';
+		s[ln->len + 1] = '\0';
+		ln->len++;
+		b->nchars++;
+
+		/* nothing for the log - its edits are all before the '\r', as the file is read again */
+		ln->stripped = 0;
+	}
+
+	b->crlf = 0;
+	snaplines_update(b, 0, buffer_nlines(b), buffer_nlines(b), NULL);
+
+	/* what's been kept for undo doesn't have the '\r's */
+	if(b->undo){
+		undo_free(b->undo);
+		b->undo = NULL;
+		b->undo_lost = 1;
+	}
+}
+
+/* read another block (or all that's left), and add its lines */
+static int buffer_loadblock(buffer_t *b, int all)
+{
+	struct loading *ld = b->loading;
+	const int first = !b->index;
+	struct loader res;
+	size_t want, len, nsplit;
+	ssize_t n = 0;
+	char *mem;
+	int eof;
+
+	if(ld->idx)
+		return buffer_loadindexed(b, all);
+
+	want = all && ld->st.st_size > ld->off ? (size_t)(ld->st.st_size - ld->off) : LOAD_BLOCK;
+	if(want < 2 * ld->ncarry)
+		want = 2 * ld->ncarry; /* a long line - don't keep re-copying it */
+	want += ld->ncarry;
+
+	if(ld->intern){
+		mem = umalloc(want + 1);
+		memcpy(mem, ld->carry, ld->ncarry);
+		free(ld->carry);
+		ld->carry = NULL;
+	}else{
+		mem = arena_alloc(b->arena, want + 1);
+		memcpy(mem, ld->carry, ld->ncarry);
+	}
+
+	for(len = ld->ncarry; len < want; len += n, ld->off += n)
+		if((n = pread(ld->fd, mem + len, want - len, ld->off)) <= 0)
+			break;
+
+	eof = len < want;
+	mem[len] = '\0';
+	if(len)
+		ld->lastc = mem[len - 1];
+
+	if(eof){
+		nsplit = len;
+		ld->ncarry = 0;
+	}else{
+		char *nl = memrchr(mem, '\n', len);
+
+		nsplit = nl ? nl + 1 - mem : 0;
+		ld->carry = mem + nsplit;
+		ld->ncarry = len - nsplit;
+	}
+
+	buffer_split(b, mem, nsplit, &res);
+
+	if(ld->index)
+		index_addlens(&res, mem + nsplit, &ld->lens, &ld->nlens);
+
+	if(first){
+		if(res.nlines || eof)
+			b->crlf = loader_crlf(&res, 1, eof);
+	}else if(b->crlf && !loader_crlf(&res, 0, eof)){
+		buffer_uncrlf(b);
+	}
+	if(b->crlf)
+		loader_stripcr(res.chain);
+
+	if(ld->intern){
+		buffer_intern(b, ld->intern, res.chain);
+
+		ld->carry = ld->ncarry ? memcpy(umalloc(ld->ncarry), ld->carry, ld->ncarry) : NULL;
+		free(mem);
+	}
+
+	if(res.chain || eof)
+		buffer_addloaded(b, res.chain);
+
+	if(eof){
+		struct stat st;
+
+		b->eol = ld->off == 0 || ld->lastc == '\n';
+
+		if(ld->index && n == 0 && fstat(ld->fd, &st) == 0
+		&& st.st_size == ld->off && st.st_mtime == ld->st.st_mtime)
+			index_save(&ld->st, b->crlf, ld->lens, ld->nlens);
+
+		buffer_stoploading(b);
+		return n < 0 ? -1 : 0;
+	}
+	return 1;
+}
+
+int buffer_read_lazy(buffer_t **buffer, FILE *f)
+{
+	struct stat st;
+	buffer_t *b;
+	int fd = fileno(f), ret;
+
+	if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (fd = dup(fd)) == -1)
+		return buffer_read(buffer, f);
+
+	b = buffer_alloc();
+	b->touched_fs = 1;
+
+	b->loading = umalloc(sizeof *b->loading);
+	memset(b->loading, '\0', sizeof *b->loading);
+	b->loading->fd = fd;
+	b->loading->st = st;
+	if(global_settings.intern)
+		b->loading->intern = intern_new();
+
+	if(index_wanted(&st)){
+		if((b->loading->idx = index_map(&st)))
+			b->crlf = b->loading->idx->crlf;
+		else
+			b->loading->index = 1;
+	}
+
+	/* enough for a line, at least */
+	do
+		ret = buffer_loadblock(b, 0);
+	while(ret > 0 && !b->index);
+
+	if(ret < 0){
+		buffer_free(b);
+		*buffer = NULL;
+		return -1;
+	}
+
+	*buffer = b;
+
+	return buffer_nchars(b);
+}
+
+int buffer_loadmore(buffer_t *b)
+{
+	return b->loading ? buffer_loadblock(b, 0) : 0;
+}
+
+void buffer_loadto(buffer_t *b, int nlines)
+{
+	while(b->loading && buffer_nlines(b) < nlines && buffer_loadblock(b, 0) > 0);
+}
+
+void buffer_loadall(buffer_t *b)
+{
+	while(b->loading && buffer_loadblock(b, 1) > 0);
+}
+
+int buffer_loaded(buffer_t *b)
+{
+	if(!b->loading)
+		return 100;
+	if(b->loading->off >= b->loading->st.st_size)
+		return 99;
+	return 100 * b->loading->off / b->loading->st.st_size;
+}
+
+/*
+ * returns bytes written
+ * if counted, l is the buffer's own lines, and their lengths are used,
+ * so any '\0's in them are written too
+ */
+static int buffer_fwrite(buffer_t *b, const struct buffer_view *v)
+{
+	const char *newline;
+	FILE *f = fopen(b->fname, "w");
+	struct list *l;
+	int eno, i;
+	long nwrite = 0;
+
+	if(!f)
+		return -1;
+
+	if(b->crlf)
+		newline = "\r\n";
+	else
+		newline = "\n";
+
+	for(i = 0, l = v->start; i < v->n; i++, l = l->next){
+		const size_t len = LINE(l)->len;
+		/* l->next: the last line only ends if the file did */
+		const size_t nl = l->next || b->eol ? strlen(newline) : 0;
+
+		if(fwrite(l->data, 1, len, f) != len || fwrite(newline, 1, nl, f) != nl){
+			nwrite = -1;
+			goto bail;
+		}
+		nwrite += len + nl;
+	}
+
+	b->opentime = time(NULL);
+	b->touched_fs = 1;
+
+	if(global_settings.fsync && (fflush(f) || fsync(fileno(f)))){
+		nwrite = -1;
+		goto bail;
+	}
+
+bail:
+	eno = errno;
+	if(fclose(f))
+		nwrite = -1;
+	else
+		errno = eno;
+
+	return nwrite;
+}
+
+int buffer_write(buffer_t *b)
+{
+	struct journal_write *jw;
+	struct buffer_view v;
+	int n;
+
+	buffer_getview(b, NULL, &v);
+
+	jw = journal_before(b);
+	n = buffer_fwrite(b, &v);
+	journal_after(b, jw, n != -1);
+	if(n != -1)
+		recover_written(b);
+
+	return n;
+}
+
+int buffer_write_view(buffer_t *b, const struct buffer_view *v)
+{
+	return buffer_fwrite(b, v);
+}
+
+void buffer_free_nolist(buffer_t *b)
+{
+	if(b){
+		free(b->fname);
+		free(b);
+	}
+}
+
+void buffer_free(buffer_t *b)
+{
+	if(b){
+		snapshot_free(b->snap);
+		ptree_unref(b->snaplines);
+		buffer_freelines(b);
+		undo_free(b->undo);
+		journal_free(b->journal);
+		recover_free(b->recover);
+		free(b->arena);
+		buffer_free_nolist(b);
+	}
+}
+
+/* l, or the first after it with data - those without are skipped, as by buffer_adopt() */
+static struct list *list_withdata(struct list *l)
+{
+	while(l && !l->data)
+		l = l->next;
+	return l;
+}
+
+static int buffer_line_is(struct list *l, const char *s)
+{
+	return (size_t)LINE(l)->len == strlen(s) && !memcmp(l->data, s, LINE(l)->len);
+}
+
+void buffer_replace(buffer_t *b, struct list *l)
+{
+	const int nold = buffer_nlines(b);
+	struct list *first = list_withdata(list_gethead(l)), *iter, *new;
+	int nnew = 0, pre = 0, suf = 0, i;
+
+	for(new = first; new; new = list_withdata(new->next))
+		nnew++;
+
+	/* most lines are usually as they were - only those between the same at either end are logged */
+	for(iter = b->lines, new = first; iter && new && buffer_line_is(iter, new->data); pre++){
+		iter = iter->next;
+		new = list_withdata(new->next);
+	}
+	if(pre < nold && pre < nnew){
+		const int n = (nold < nnew ? nold : nnew) - pre;
+
+		for(iter = buffer_getindex(b, nold - n), new = first, i = 0; i < nnew - n; i++)
+			new = list_withdata(new->next);
+		for(; new; iter = iter->next, new = list_withdata(new->next))
+			suf = buffer_line_is(iter, new->data) ? suf + 1 : 0;
+	}
+
+	undo_lines_begin(b, 0);
+	for(iter = b->lines; iter; iter = iter->next)
+		undo_lines_old(b, iter->data, LINE(iter)->len);
+	recover_lines_begin(b, pre, nold - pre - suf);
+
+	buffer_freelines(b);
+	buffer_splice(b, 0, buffer_adopt(b, l));
+	nnew = buffer_nlines(b); /* there's a line, even if l had none */
+
+	for(iter = b->lines, i = 0; iter; iter = iter->next, i++){
+		undo_lines_new(b, iter->data, LINE(iter)->len);
+		if(i >= pre && i < nnew - suf)
+			recover_line(b, iter->data, LINE(iter)->len);
+	}
+	undo_lines_end(b);
+	recover_lines_end(b);
+
+	snaplines_update(b, 0, nold, buffer_nlines(b), NULL);
+}
+
+int buffer_nchars(buffer_t *b)
+{
+	return b->nchars;
+}
+
+int buffer_nlines(buffer_t *b)
+{
+	return tree_count(b->index);
+}
+
+size_t buffer_memsize(buffer_t *b)
+{
+	return sizeof *b + b->nchars + buffer_nlines(b) * (sizeof(struct line) + sizeof(struct pentry));
+}
+
+struct list *buffer_getindex(buffer_t *b, int i)
+{
+	return (struct list *)tree_index(b->index, i);
+}
+
+int buffer_indexof(buffer_t *b, struct list *l)
+{
+	return tree_rank((struct tnode *)l);
+}
+
+struct list *buffer_gettail(buffer_t *b)
+{
+	return (struct list *)tree_last(b->index);
+}
+
+/* buffer_splice(), for changes that can be undone */
+static void buffer_insert(buffer_t *b, int i, struct tnode *chain)
+{
+	struct tnode *t;
+	int n = 0;
+
+	undo_lines_begin(b, i);
+	recover_lines_begin(b, i, 0);
+	for(t = chain; t; t = (struct tnode *)t->l.next, n++){
+		undo_lines_new(b, t->l.data, LINE(t)->len);
+		recover_line(b, t->l.data, LINE(t)->len);
+	}
+	undo_lines_end(b);
+	recover_lines_end(b);
+
+	buffer_splice(b, i, chain);
+	snaplines_update(b, i, 0, n, NULL);
+}
+
+/*
+ * extract lines for removal, recording them for undo - buffer_unlinked() after
+ * *n is how many to take, then how many were
+ */
+static struct tnode *buffer_unlink(buffer_t *b, int i, int *n)
+{
+	const int before = buffer_nlines(b);
+	struct tnode *t, *chain = tree_extract(&b->index, i, *n);
+
+	*n = before - buffer_nlines(b);
+
+	undo_lines_begin(b, i);
+	for(t = chain; t; t = (struct tnode *)t->l.next)
+		undo_lines_old(b, t->l.data, LINE(t)->len);
+	recover_lines_begin(b, i, *n);
+
+	return chain;
+}
+
+static void buffer_unlinked(buffer_t *b, int i, int n)
+{
+	const int empty = !b->index;
+
+	buffer_splice(b, 0, NULL);
+
+	/* the empty line put in its place is part of the same change */
+	if(empty){
+		undo_lines_new(b, "", 0);
+		recover_line(b, "", 0);
+	}
+	undo_lines_end(b);
+	recover_lines_end(b);
+
+	snaplines_update(b, i, n, empty, NULL);
+}
+
+void buffer_insertbefore(buffer_t *b, struct list *l, void *d)
+{
+	buffer_insert(b, buffer_indexof(b, l), buffer_newline(b, d));
+}
+
+void buffer_insertafter(buffer_t *b, struct list *l, void *d)
+{
+	buffer_insert(b, buffer_indexof(b, l) + 1, buffer_newline(b, d));
+}
+
+void buffer_insertafter_len(buffer_t *b, struct list *l, void *d, int len)
+{
+	struct tnode *t = buffer_newline(b, d);
+
+	LINE(t)->len = len;
+	buffer_insert(b, buffer_indexof(b, l) + 1, t);
+}
+
+void buffer_insertlistbefore(buffer_t *b, struct list *l, struct list *new)
+{
+	buffer_insert(b, buffer_indexof(b, l), buffer_adopt(b, new));
+}
+
+void buffer_insertlistafter(buffer_t *b, struct list *l, struct list *new)
+{
+	buffer_insert(b, buffer_indexof(b, l) + 1, buffer_adopt(b, new));
+}
+
+void buffer_sharelistbefore(buffer_t *b, struct list *l, struct list *shared)
+{
+	buffer_insert(b, buffer_indexof(b, l), buffer_adopt_shared(b, shared));
+}
+
+void buffer_sharelistafter(buffer_t *b, struct list *l, struct list *shared)
+{
+	buffer_insert(b, buffer_indexof(b, l) + 1, buffer_adopt_shared(b, shared));
+}
+
+void *buffer_extract(buffer_t *b, struct list *l)
+{
+	const int i = buffer_indexof(b, l);
+	int n = 1;
+	struct tnode *t = buffer_unlink(b, i, &n);
+	void *d = buffer_releaseline(b, t, 1);
+
+	buffer_unlinked(b, i, n);
+
+	return d;
+}
+
+void buffer_remove_range(buffer_t *buffer, struct range *rng)
+{
+	struct tnode *t, *next;
+	int n;
+
+	n = rng->end - rng->start + 1;
+	t = buffer_unlink(buffer, rng->start, &n);
+
+	for(; t; t = next){
+		next = (struct tnode *)t->l.next;
+		buffer_releaseline(buffer, t, 0);
+	}
+
+	buffer_unlinked(buffer, rng->start, n);
+}
+
+struct list *buffer_extract_range(buffer_t *buffer, struct range *rng)
+{
+	struct tnode *t, *next;
+	struct list *new, *tail;
+	int n;
+
+	n = rng->end - rng->start + 1;
+	t = buffer_unlink(buffer, rng->start, &n);
+
+	tail = new = list_new(NULL);
+	for(; t; t = next){
+		next = (struct tnode *)t->l.next;
+		list_append(tail, buffer_releaseline(buffer, t, 1));
+		tail = list_gettail(tail);
+	}
+
+	/* if we just deleted everything, this makes an empty line */
+	buffer_unlinked(buffer, rng->start, n);
+
+	return new;
+}
+
+struct list *buffer_extract_range_shared(buffer_t *buffer, struct range *rng)
+{
+	struct tnode *t, *next;
+	struct list *new, *tail;
+	int n;
+
+	n = rng->end - rng->start + 1;
+	t = buffer_unlink(buffer, rng->start, &n);
+
+	tail = new = list_new(NULL);
+	for(; t; t = next){
+		next = (struct tnode *)t->l.next;
+		list_append(tail, buffer_line_share(buffer, &t->l));
+		tail = list_gettail(tail);
+		buffer_releaseline(buffer, t, 0);
+	}
+
+	buffer_unlinked(buffer, rng->start, n);
+
+	return new;
+}
+
+/* d, a malloc()ed copy, replaces a line's borrowed, inline or shared data */
+static void buffer_line_own(buffer_t *b, struct line *ln, char *d)
+{
+	if(ln->borrowed){
+		ln->borrowed = 0;
+		b->nborrowed--;
+	}else if(ln->shared){
+		ln->shared = 0;
+		str_unref(ln->t.l.data);
+	}
+	ln->t.l.data = d;
+}
+
+void buffer_line_edit(buffer_t *b, struct list *l)
+{
+	struct line *ln = LINE(l);
+	const int y = buffer_indexof(b, l);
+
+	undo_line_edit(b, y, l->data, ln->len);
+	recover_line_edit(b, y, l->data, ln->len);
+
+	if(!LINE_MALLOCED(ln))
+		buffer_line_own(b, ln, line_dup(ln));
+
+	/* whoever's editing may realloc() it to any size */
+	ln->cap = 0;
+}
+
+char *buffer_line_reserve(buffer_t *b, struct list *l, int n)
+{
+	const int y = buffer_indexof(b, l);
+
+	undo_line_edit(b, y, l->data, LINE(l)->len);
+	recover_line_edit(b, y, l->data, LINE(l)->len);
+	return buffer_line_room(b, l, n);
+}
+
+/* buffer_line_reserve(), without the undo or recovery */
+static char *buffer_line_room(buffer_t *b, struct list *l, int n)
+{
+	struct line *ln = LINE(l);
+	const int need = ln->len + n + 1;
+
+	if(!LINE_MALLOCED(ln)){
+		char *d = umalloc(need);
+
+		memcpy(d, l->data, ln->len + 1);
+		buffer_line_own(b, ln, d);
+		ln->cap = need;
+
+	}else if(ln->cap < need){
+		/* doubling, so appending a bit at a time is amortised O(1) */
+		ln->cap = need < 2 * ln->cap ? 2 * ln->cap : need;
+		l->data = urealloc(l->data, ln->cap);
+	}
+
+	return l->data;
+}
+
+/* len is l's new length */
+static void buffer_line_resized(buffer_t *b, struct list *l, int len)
+{
+	struct line *ln = LINE(l);
+
+	const int y = buffer_indexof(b, l);
+
+	b->nchars += len - ln->len;
+	ln->len = len;
+	buffer_changed(b);
+
+	if(len < LINE_INLINE && LINE_MALLOCED(ln)){
+		memcpy(ln->inl, l->data, len + 1);
+		free(l->data);
+		l->data = ln->inl;
+		ln->cap = 0;
+	}else if(ln->cap < len + 1){
+		ln->cap = len + 1;
+	}
+
+	snaplines_update(b, y, 1, 1, l);
+}
+
+void buffer_line_changed(buffer_t *b, struct list *l, int len)
+{
+	const int y = buffer_indexof(b, l);
+
+	buffer_line_resized(b, l, len);
+	recover_line_changed(b, y, l->data, len);
+	undo_line_changed(b, y, l->data, len);
+}
+
+/*
+ * in place, so there's one memmove() of what's after x, rather than
+ * copying and rescanning the whole line - and only the bytes put in or
+ * taken out go to the recovery log
+ */
+void buffer_line_insert(buffer_t *b, struct list *l, int x, const char *s, int n)
+{
+	const int len = LINE(l)->len, y = buffer_indexof(b, l);
+	char *data;
+
+	if(x > len)
+		x = len;
+
+	undo_chars(b, y, x, "", 0, s, n);
+	recover_chars(b, y, x, 0, s, n);
+
+	data = buffer_line_room(b, l, n);
+	memmove(data + x + n, data + x, len - x + 1);
+	memcpy(data + x, s, n);
+
+	buffer_line_resized(b, l, len + n);
+}
+
+void buffer_line_delete(buffer_t *b, struct list *l, int x, int n)
+{
+	const int len = LINE(l)->len, y = buffer_indexof(b, l);
+	char *data = LINE(l)->shared || (LINE(l)->borrowed && b->store)
+		? buffer_line_room(b, l, 0) : l->data;
+
+	if(x > len)
+		x = len;
+	if(n > len - x)
+		n = len - x;
+
+	undo_chars(b, y, x, data + x, n, "", 0);
+	recover_chars(b, y, x, n, "", 0);
+
+	/* what was read is ours to change (unless snapshotted), as is inl[] - they only can't grow */
+	memmove(data + x, data + x + n, len - x - n + 1);
+
+	buffer_line_resized(b, l, len - n);
+}
+
+int buffer_line_len(struct list *l)
+{
+	return LINE(l)->len;
+}
+
+struct list *buffer_share_range(buffer_t *b, struct range *rng)
+{
+	struct list *new, *tail, *l;
+	int i;
+
+	tail = new = list_new(NULL);
+
+	for(i = rng->start, l = buffer_getindex(b, i);
+			l && i <= rng->end;
+			i++, l = l->next){
+		list_append(tail, buffer_line_share(b, l));
+		tail = list_gettail(tail);
+	}
+
+	return new;
+}
+
+void buffer_getview(buffer_t *b, struct range *rng, struct buffer_view *v)
+{
+	if(!rng){
+		buffer_loadall(b);
+		v->start = b->lines;
+		v->n = buffer_nlines(b);
+		return;
+	}
+
+	buffer_loadto(b, rng->end + 2);
+	v->start = buffer_getindex(b, rng->start);
+	v->n = 0;
+	if(v->start){
+		v->n = rng->end - rng->start + 1;
+		if(v->n > buffer_nlines(b) - rng->start)
+			v->n = buffer_nlines(b) - rng->start;
+	}
+}
+
+static void store_unref(struct buffer_store *st)
+{
+	if(st && !ATOMIC_ADD(&st->refs, -1)){
+		free(st->mem);
+		arena_free(&st->arena);
+		free(st);
+	}
+}
+
+/* what a snapshot sees of l - other than shared or borrowed lines, that's decided when one's taken */
+static struct pentry line_entry(struct list *l)
+{
+	struct pentry e;
+
+	e.len = LINE(l)->len;
+	LINE(l)->dirty = 0;
+	if(LINE(l)->borrowed){
+		e.s = l->data;
+		e.flags = 0;
+	}else if(LINE(l)->shared){
+		e.s = str_ref(l->data);
+		e.flags = PT_REF;
+	}else{
+		e.s = (const char *)l;
+		e.flags = PT_DIRTY;
+		LINE(l)->dirty = 1;
+	}
+	return e;
+}
+
+/* a copy of a line changed since the last snapshot, which the line itself keeps out of */
+static void line_resolve(struct pentry *e, void *ctx)
+{
+	struct list *l = (struct list *)e->s;
+
+	(void)ctx;
+
+	LINE(l)->dirty = 0;
+	e->len = LINE(l)->len;
+	if(LINE(l)->shared)
+		e->s = str_ref(l->data);
+	else
+		e->s = str_share(l->data, LINE(l)->len);
+	e->flags = PT_REF;
+}
+
+/*
+ * b->snaplines follows a change once it's made: lines [y, y + nold) were
+ * replaced by nnew lines, which may have been loaded lazily. l is line y,
+ * if the caller has it
+ */
+static void snaplines_update(buffer_t *b, int y, int nold, int nnew, struct list *l)
+{
+	struct pentry *e;
+	int i;
+
+	if(!l)
+		l = buffer_getindex(b, y);
+
+	/* a line edited again keeps the entry it has - the usual case */
+	if(nold == 1 && nnew == 1 && LINE(l)->dirty && !LINE(l)->borrowed && !LINE(l)->shared)
+		return;
+
+	e = nnew ? umalloc(nnew * sizeof *e) : NULL;
+	for(i = 0; i < nnew; i++, l = l->next)
+		e[i] = line_entry(l);
+	ptree_splice(&b->snaplines, y, nold, e, nnew);
+	free(e);
+}
+
+/* b->gen is bumped by every change, which the cached snapshot would only hold on to */
+static void buffer_changed(buffer_t *b)
+{
+	b->gen++;
+
+	if(b->snap){
+		snapshot_free(b->snap);
+		b->snap = NULL;
+	}
+}
+
+struct snapshot *buffer_snapshot(buffer_t *b)
+{
+	struct snapshot *snap;
+
+	/* unchanged since the last one */
+	if((snap = b->snap) && snap->eol == b->eol && snap->crlf == b->crlf)
+		return snapshot_ref(snap);
+
+	snapshot_free(b->snap);
+
+	if(!b->store){
+		/* the buffer's reference, dropped once it's done with the memory */
+		b->store = umalloc(sizeof *b->store);
+		memset(b->store, '\0', sizeof *b->store);
+		b->store->refs = 1;
+	}
+
+	/* the lines changed since the last are copied - the rest are shared as they are */
+	ptree_resolve(&b->snaplines, line_resolve, NULL);
+
+	snap = umalloc(sizeof *snap);
+	snap->refs     = 2; /* b->snap, and the caller */
+	snap->eol      = b->eol;
+	snap->crlf     = b->crlf;
+	snap->complete = !b->loading;
+	snap->lines    = ptree_ref(b->snaplines);
+	snap->store    = b->store;
+	ATOMIC_ADD(&snap->store->refs, 1);
+
+	return b->snap = snap;
+}
+
+struct snapshot *snapshot_ref(struct snapshot *snap)
+{
+	ATOMIC_ADD(&snap->refs, 1);
+	return snap;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+	if(!snap || ATOMIC_ADD(&snap->refs, -1))
+		return;
+
+	ptree_unref(snap->lines);
+	store_unref(snap->store);
+	free(snap);
+}
+
+int snapshot_nlines(const struct snapshot *snap)
+{
+	return ptree_count(snap->lines);
+}
+
+const char *snapshot_line(const struct snapshot *snap, int i, int *len)
+{
+	const struct pentry *e = ptree_index(snap->lines, i);
+
+	if(len)
+		*len = e->len;
+	return e->s;
+}
+
+int snapshot_complete(const struct snapshot *snap)
+{
+	return snap->complete;
+}
+
+int snapshot_eol(const struct snapshot *snap)
+{
+	return snap->eol;
+}
+
+int snapshot_crlf(const struct snapshot *snap)
+{
+	return snap->crlf;
 }
 
 void buffer_dump(buffer_t *b, FILE *f)
@@ -1,20 +1,49 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+/*
+ * n lines in place, from start - nothing's copied, so a view is only
+ * good until the buffer next changes
+ */
+struct buffer_view
+{
+	struct list *start;
+	int n;
+};
+
 typedef struct
 {
-	struct list *lines;
-	/* TODO: jump list to lines->gethead(), etc */
+	struct list *lines; /* head */
+	struct tnode *index; /* the same lines, as an order-statistic tree */
+	int nchars; /* kept up to date by the functions below */
+
+	/* lines come from here */
+	struct arena *arena;
+	struct line *spare;
+
+	/* the file, as read - lines point into it until they're edited */
+	char *mem;
+	int nborrowed;
+	long interned; /* bytes saved sharing lines as they were read - less the copies and table, so may be < 0 */
+
+	struct loading *loading; /* the rest of the file, if loading lazily */
+	struct undo *undo;
+	struct journal *journal; /* earlier saved versions, once asked for */
+	struct recover *recover; /* the log of changes since the last write */
+	unsigned long gen; /* bumped by every change */
+
+	struct pnode *snaplines; /* the lines as snapshots see them, kept up to date as they change */
+	struct snapshot *snap; /* the last snapshot, until the next change */
+	struct buffer_store *store; /* mem and the arena, if snapshots point into them */
 
 	char *fname;
 	int readonly;
 	int modified;
 	int eol;
 	int crlf;
+	int undo_lost; /* undo was forgotten, as loading found the file isn't crlf */
 
 	/* internal variables */
-	int dirty;
-	int nlines;
 	int touched_fs; /* if we have read or written to the file system */
 	time_t opentime;
 } buffer_t;
@@ -24,7 +53,17 @@ buffer_t *buffer_new_empty(void);
 buffer_t *buffer_new_list(struct list *l);
 
 int buffer_read(buffer_t **, FILE *f);
-int buffer_write_list(buffer_t *b, struct list *l);
+
+/*
+ * lazy loading - buffer_read_lazy() reads just the start of the file,
+ * the rest as buffer_loadmore() is called, or when lines are needed
+ */
+int  buffer_read_lazy(buffer_t **, FILE *f);
+int  buffer_loadmore(buffer_t *); /* 1: more to come, 0: done, -1: read error */
+void buffer_loadto(  buffer_t *, int nlines);
+void buffer_loadall( buffer_t *);
+int  buffer_loaded(  buffer_t *); /* percentage */
+int buffer_write_view(buffer_t *, const struct buffer_view *); /* just those lines */
 int buffer_write(buffer_t *);
 int buffer_external_modified(buffer_t *);
 
@@ -33,17 +72,15 @@ void buffer_free_nolist(buffer_t *); /* free(), leaving the list in memory */
 
 void buffer_replace(buffer_t *, struct list *);
 
+/* O(1) - maintained as the buffer changes */
 int buffer_nchars(buffer_t *);
 int buffer_nlines(buffer_t *);
+size_t buffer_memsize(buffer_t *); /* roughly */
 
 void buffer_setfilename(buffer_t *, const char *);
 
 int buffer_file_exists(buffer_t *b);
 
-/* these can't be macros, since the buffer list pointer needs to be adjusted */
-void buffer_remove_range(buffer_t *, struct range *);
-struct list *buffer_extract_range(buffer_t *, struct range *);
-
 void buffer_dump(buffer_t *, FILE *);
 
 /* list wrappers */
@@ -60,28 +97,85 @@ void buffer_dump(buffer_t *, FILE *);
 #define buffer_hasfilename(b)             (!!(b)->fname)
 
 #define buffer_touched_filesystem(b)      ((b)->touched_fs)
+#define buffer_loading(b)                 (!!(b)->loading)
 
 
-/* functions that change the buffer */
-#define buffer_insertbefore(b, l, d)      ( (b)->dirty = 1, list_insertbefore      ( l, d )         )
-#define buffer_insertafter(b, l, d)       ( (b)->dirty = 1, list_insertafter       ( l, d )         )
-#define buffer_append(b, l, d)            ( (b)->dirty = 1, list_append            ( l, d )         )
-#define buffer_insertlistbefore(b, l, m)  ( (b)->dirty = 1, list_insertlistbefore  ( l, m )         )
-#define buffer_insertlistafter(b, l, m)   ( (b)->dirty = 1, list_insertlistafter   ( l, m )         )
-#define buffer_appendlist(b, l)           ( (b)->dirty = 1, list_appendlist        ( b2l(b), l )    )
+/*
+ * functions that change the buffer
+ * these can't be macros, since the buffer's index needs to be adjusted
+ */
+void buffer_insertbefore(    buffer_t *, struct list *, void *);
+void buffer_insertafter(     buffer_t *, struct list *, void *);
+void buffer_insertafter_len( buffer_t *, struct list *, void *, int len); /* '\0's and all */
+void buffer_insertlistbefore(buffer_t *, struct list *, struct list *);
+void buffer_insertlistafter( buffer_t *, struct list *, struct list *);
 
-#define buffer_extract(b, l)              ( (b)->dirty = 1, list_extract           (l)              )
-#define buffer_remove(b, l)               ( (b)->dirty = 1, list_remove            (l)              )
-
-#define buffer_copy_range(b, r)           list_copy_range(b2l(b), (void *(*)(void *))ustrdup, r)
-
-/* read only functions */
-#define buffer_getindex(b, m)             list_getindex ( b2l(b), m)
-/* TODO: jump table in buffer? */
-#define buffer_indexof(b, l)              list_indexof  ( b2l(b), l)
+void        *buffer_extract(      buffer_t *, struct list *);
+void         buffer_remove_range( buffer_t *, struct range *);
+struct list *buffer_extract_range(buffer_t *, struct range *);
 
-/* TODO: store head and tail pointers in buffer */
-#define buffer_gethead(b)                 list_gethead  ( b2l(b) )
-#define buffer_gettail(b)                 list_gettail  ( b2l(b) )
+/*
+ * lists of str_share()d lines, for registers - taking or putting
+ * these only takes a reference to each line, not a copy of it.
+ * the buffer copies a shared line before it's changed
+ */
+void         buffer_sharelistbefore(     buffer_t *, struct list *, struct list *);
+void         buffer_sharelistafter(      buffer_t *, struct list *, struct list *);
+struct list *buffer_extract_range_shared(buffer_t *, struct range *);
+struct list *buffer_share_range(         buffer_t *, struct range *);
+
+/*
+ * changing a line's data must be bracketed by these:
+ * buffer_line_edit() makes l->data safe to realloc() or free(),
+ * buffer_line_reserve() instead makes room for n more bytes, without
+ * realloc()ing each time, and buffer_line_changed() updates the counts
+ * afterwards, given the line's new length - it may have '\0's in it
+ */
+void         buffer_line_edit(    buffer_t *, struct list *);
+char        *buffer_line_reserve( buffer_t *, struct list *, int n);
+void         buffer_line_changed( buffer_t *, struct list *, int len);
+
+/*
+ * these don't need bracketing. they cost O(the line), not O(the edit) -
+ * what's after x is moved, though only the edit is logged for recovery.
+ * there's no gap kept in long lines: l->data is read as a whole string
+ * everywhere, and would have to be closed up before each redraw
+ */
+void         buffer_line_insert(  buffer_t *, struct list *, int x, const char *, int n);
+void         buffer_line_delete(  buffer_t *, struct list *, int x, int n);
+
+/* O(1), unlike strlen() - lines read in can have '\0's in them */
+int          buffer_line_len(struct list *);
+
+#define buffer_append(b, l, d)            buffer_insertafter(     b, buffer_gettail(b), d)
+#define buffer_appendlist(b, l)           buffer_insertlistafter( b, buffer_gettail(b), l)
+#define buffer_remove(b, l)               free(buffer_extract(b, l))
+
+void         buffer_getview(buffer_t *, struct range *, struct buffer_view *); /* NULL for them all */
+
+/*
+ * a snapshot is the buffer as it was, which other threads can read
+ * without locking while it's changed. taking one shares the buffer's
+ * tree of lines, copying only lines changed since the last snapshot -
+ * the buffer copies the tree's nodes as it changes them, not the other
+ * way round. it has the lines loaded so far, and loads no more.
+ * the last snapshot_free() frees it, from any thread
+ */
+struct snapshot *buffer_snapshot(buffer_t *);
+struct snapshot *snapshot_ref(  struct snapshot *);
+void             snapshot_free( struct snapshot *);
+
+int              snapshot_nlines(  const struct snapshot *); /* O(1) */
+const char      *snapshot_line(    const struct snapshot *, int i, int *len); /* O(log n), '\0' terminated too */
+int              snapshot_eol(     const struct snapshot *);
+int              snapshot_crlf(    const struct snapshot *);
+int              snapshot_complete(const struct snapshot *); /* 0 if the file was still loading */
+
+/* read only functions - O(log n) via the index */
+struct list *buffer_getindex(buffer_t *, int);
+int          buffer_indexof( buffer_t *, struct list *);
+struct list *buffer_gettail( buffer_t *);
+
+#define buffer_gethead(b)                 b2l(b)
 
 #endif
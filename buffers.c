@@ -5,23 +5,40 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "range.h"
 #include "buffer.h"
 #include "buffers.h"
+#include "global.h"
 #include "gui/gui.h"
 #include "util/io.h"
 #include "util/alloc.h"
+#include "util/str.h"
+#include "recover.h"
 
 static buffer_t *current_buf;
 
 static int arg_ro = 0;
+static int arg_lazy = 0;
+static int arg_recover = 0;
 
 static struct old_buffer **fnames;
 
+/* fnames indexes by canonical name, open addressed - -1 is a free slot */
+static int *hash_tab;
+static size_t hash_size; /* a power of two, at least twice count */
+
 static int last    = -1;
 static int current = -1;
 static int count;
+static int ahead; /* the next file to read ahead */
+
+/* buffers kept in memory, most recently used first */
+static struct old_buffer *lru_head, *lru_tail;
+static size_t lru_mem;
 
 struct old_buffer **buffers_array()
 {
@@ -56,21 +73,190 @@ int buffers_alternate_idx()
 	return last;
 }
 
+/* a//b, a/./b and ./a/ are a/b, a/b and a - lexically, so no lookups */
+static char *buffers_canon(const char *fname)
+{
+	char *s = ustrdup(fname), *in, *out;
+
+	for(in = out = s; *in; ){
+		const int component = out == s || out[-1] == '/';
+
+		if(component && in > s && *in == '/'){
+			in++;
+			continue;
+		}
+		if(component && in[0] == '.' && (in[1] == '/' || !in[1])){
+			in += in[1] ? 2 : 1;
+			continue;
+		}
+		*out++ = *in++;
+	}
+
+	if(out > s + 1 && out[-1] == '/')
+		out--;
+	if(out == s)
+		*out++ = '.';
+	*out = '\0';
+
+	return s;
+}
+
 struct old_buffer *new_old_buf(const char *fname)
 {
 	struct old_buffer *b;
 	b = umalloc(sizeof *b);
 	memset(b, 0, sizeof *b);
 	b->fname  = ustrdup(fname);
+	b->key    = buffers_canon(fname);
 	return b;
 }
 
+/* the slot key is in, or the free one it'd go in */
+static size_t buffers_slot(const char *key)
+{
+	size_t i = str_hash(STR_HASH_INIT, key, strlen(key)) & (hash_size - 1);
+
+	while(hash_tab[i] != -1 && strcmp(fnames[hash_tab[i]]->key, key))
+		i = (i + 1) & (hash_size - 1);
+
+	return i;
+}
+
+static void buffers_rehash(size_t size)
+{
+	int i;
+
+	if(size > hash_size){
+		hash_size = size;
+		hash_tab = urealloc(hash_tab, hash_size * sizeof *hash_tab);
+	}
+	memset(hash_tab, 0xff, hash_size * sizeof *hash_tab);
+
+	for(i = 0; i < count; i++)
+		hash_tab[buffers_slot(fnames[i]->key)] = i;
+}
+
+/* fnames[count] is new - make room and index it */
+static void buffers_hashadd(void)
+{
+	if((size_t)(count + 1) * 2 > hash_size){
+		size_t size = hash_size ? hash_size : 64;
+
+		while(size < (size_t)(count + 1) * 2)
+			size *= 2;
+		buffers_rehash(size);
+	}
+
+	hash_tab[buffers_slot(fnames[count]->key)] = count;
+	count++;
+}
+
+static void buffers_showinfo(buffer_t *b, const char *filename)
+{
+	gui_status(GUI_NONE, "%s%s: %dC, %dL%s%s",
+			filename,
+			buffer_readonly(b) ? " [read only]" : "",
+			buffer_nchars(b),
+			buffer_nlines(b),
+			buffer_eol(b)  ? "" : " [noeol]",
+			buffer_crlf(b) ? " [crlf]" : ""
+			);
+}
+
+static void lru_unlink(struct old_buffer *ob)
+{
+	if(ob->lru_prev)
+		ob->lru_prev->lru_next = ob->lru_next;
+	else
+		lru_head = ob->lru_next;
+
+	if(ob->lru_next)
+		ob->lru_next->lru_prev = ob->lru_prev;
+	else
+		lru_tail = ob->lru_prev;
+
+	ob->lru_prev = ob->lru_next = NULL;
+	lru_mem -= ob->mem;
+}
+
+/* take ob's buffer back out of the cache */
+static buffer_t *lru_take(struct old_buffer *ob)
+{
+	buffer_t *b = ob->buf;
+
+	if(b){
+		lru_unlink(ob);
+		ob->buf = NULL;
+	}
+	return b;
+}
+
+static void lru_drop(struct old_buffer *ob)
+{
+	buffer_free(lru_take(ob));
+}
+
+/* drop the least recently used, until there's room - modified buffers are always kept */
+static void lru_trim(void)
+{
+	const size_t max = (size_t)global_settings.bufmem * 1024 * 1024;
+	struct old_buffer *iter, *prev;
+
+	for(iter = lru_tail; iter && lru_mem > max; iter = prev){
+		prev = iter->lru_prev;
+		if(!buffer_modified(iter->buf))
+			lru_drop(iter);
+	}
+}
+
+/* keep b in memory, as ob's, while there's room */
+static void lru_keep(struct old_buffer *ob, buffer_t *b)
+{
+	ob->buf = b;
+	ob->mem = buffer_memsize(b);
+	lru_mem += ob->mem;
+
+	if((ob->lru_next = lru_head))
+		lru_head->lru_prev = ob;
+	else
+		lru_tail = ob;
+	lru_head = ob;
+
+	lru_trim();
+}
+
+/* ob's buffer has grown, as it's loaded */
+static void lru_resize(struct old_buffer *ob)
+{
+	lru_mem -= ob->mem;
+	ob->mem = buffer_memsize(ob->buf);
+	lru_mem += ob->mem;
+
+	lru_trim();
+}
+
+/* returns what buffer_read() does */
+static int buffers_read(buffer_t **pb, FILE *f, const char *filename, int noro)
+{
+	struct stat st;
+	int nread, lazy;
+
+	lazy = arg_lazy || (global_settings.lazy
+			&& fstat(fileno(f), &st) == 0
+			&& st.st_size >= (off_t)global_settings.lazy * 1024 * 1024);
+
+	nread = lazy ? buffer_read_lazy(pb, f) : buffer_read(pb, f);
+
+	if(nread != -1 && !noro)
+		buffer_readonly(*pb) = access(filename, W_OK);
+
+	return nread;
+}
+
 static buffer_t *buffers_readfile(FILE *f, const char *filename, int noro)
 {
 	buffer_t *b;
-	int nread;
-
-	nread = buffer_read(&b, f);
+	const int nread = buffers_read(&b, f, filename, noro);
 
 	if(nread == -1){
 		gui_status(GUI_ERR, "read \"%s\": %s",
@@ -78,25 +264,120 @@ static buffer_t *buffers_readfile(FILE *f, const char *filename, int noro)
 				errno ? strerror(errno) : "unknown error - binary file?");
 
 	}else{
-		if(!noro)
-			buffer_readonly(b) = access(filename, W_OK);
-
-		if(nread == 0)
+		if(buffer_loading(b))
+			gui_status(GUI_NONE, "%s%s: loading, %d%%", filename,
+					buffer_readonly(b) ? " [read only]" : "",
+					buffer_loaded(b));
+		else if(nread == 0)
 			gui_status(GUI_NONE, "%s: empty file%s", filename, buffer_readonly(b) ? " [read only]" : "");
 		else
-			gui_status(GUI_NONE, "%s%s: %dC, %dL%s%s",
-					filename,
-					buffer_readonly(b) ? " [read only]" : "",
-					buffer_nchars(b),
-					buffer_nlines(b),
-					buffer_eol(b)  ? "" : " [noeol]",
-					buffer_crlf(b) ? " [crlf]" : ""
-					);
+			buffers_showinfo(b, filename);
 	}
 
 	return b;
 }
 
+/* the kernel can start reading the next few files now */
+static void buffers_readahead_hint(void)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int i, fd;
+
+	for(i = current + 1; i < count && i <= current + global_settings.readahead; i++)
+		if(!fnames[i]->buf && (fd = open(fnames[i]->fname, O_RDONLY)) != -1){
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+#endif
+}
+
+/*
+ * read a block of the next file we've not got in memory, so there's
+ * never much to do between keys - returns 1 if there may be more
+ */
+static int buffers_readahead(void)
+{
+	const off_t max = (off_t)global_settings.bufmem * 1024 * 1024;
+	struct old_buffer *ob;
+	struct stat st;
+	buffer_t *b;
+	FILE *f;
+
+	while(ahead < count && ahead <= current + global_settings.readahead
+	&& fnames[ahead]->buf && !buffer_loading(fnames[ahead]->buf))
+		ahead++;
+	if(current == -1 || ahead >= count || ahead > current + global_settings.readahead)
+		return 0;
+
+	ob = fnames[ahead];
+
+	if(ob->buf){
+		if(buffer_loadmore(ob->buf) == -1)
+			lru_drop(ob);
+		else
+			lru_resize(ob);
+
+		/* gone, to make room, or no good */
+		if(!ob->buf)
+			ahead++;
+		return 1;
+	}
+
+	/* one too big to keep would only push the others out */
+	if((f = fopen(ob->fname, "r"))){
+		if(fstat(fileno(f), &st) == 0 && st.st_size <= max
+		&& buffer_read_lazy(&b, f) != -1){
+			buffer_readonly(b) = arg_ro || access(ob->fname, W_OK);
+			buffer_setfilename(b, ob->fname);
+			lru_keep(ob, b);
+		}
+		fclose(f);
+	}
+
+	if(!ob->buf)
+		ahead++;
+	return 1;
+}
+
+int buffers_idle()
+{
+	static int last_pct = -1;
+	buffer_t *b = current_buf;
+	int pct;
+
+	/* once loaded, so it isn't lost under the percentage */
+	if(b && !buffer_loading(b) && b->undo_lost){
+		gui_status(GUI_ERR, "%s: not crlf after all - undo history lost", buffer_filename(b));
+		b->undo_lost = 0;
+		return 1;
+	}
+
+	if(!b || !buffer_loading(b))
+		/* the recovery log is only looked for as a file's switched to */
+		return !arg_recover && buffers_readahead();
+
+	switch(buffer_loadmore(b)){
+		case 1:
+			if((pct = buffer_loaded(b)) != last_pct)
+				gui_status(GUI_NONE, "%s: loading, %d%%", buffer_filename(b), last_pct = pct);
+			return 1;
+
+		case 0:
+			if(b->undo_lost){
+				last_pct = -1;
+				return 1; /* said next time */
+			}
+			buffers_showinfo(b, buffer_filename(b));
+			break;
+
+		default:
+			gui_status(GUI_ERR, "read \"%s\": %s", buffer_filename(b), strerror(errno));
+	}
+
+	last_pct = -1;
+	return 0;
+}
+
 static buffer_t *buffers_readfname(const char *filename)
 {
 	buffer_t *b = NULL;
@@ -131,9 +412,9 @@ newfile:
 	return b;
 }
 
-void buffers_init(int argc, const char **argv, int ro)
+void buffers_init(int argc, const char **argv, int ro, int lazy, int recover)
 {
-	int i, bufidx;
+	int i;
 	int read_stdin = 0;
 
 	if(argc > 0 && !strcmp(argv[0], "-")){
@@ -145,23 +426,24 @@ void buffers_init(int argc, const char **argv, int ro)
 
 	count  = argc;
 	arg_ro = ro;
+	arg_lazy = lazy;
+	arg_recover = recover;
 
 	fnames = umalloc((count + 1) * sizeof *fnames);
-	bufidx = 0;
-
-	for(i = 0; i < count; i++){
-		int j, found = 0;
-		for(j = 0; j < i; j++)
-			if(!strcmp(argv[i], argv[j])){
-				found = 1;
-				break;
-			}
-
-		if(!found)
-			fnames[bufidx++] = new_old_buf(argv[i]);
+	count = 0;
+
+	for(i = 0; i < argc; i++){
+		fnames[count] = new_old_buf(argv[i]);
+		if(count > 0 && hash_tab[buffers_slot(fnames[count]->key)] != -1){
+			free(fnames[count]->fname);
+			free(fnames[count]->key);
+			free(fnames[count]);
+		}else{
+			buffers_hashadd();
+		}
 	}
 
-	fnames[count = bufidx] = NULL;
+	fnames[count] = NULL;
 
 	current = count > 0 ? 0 : -1;
 
@@ -177,6 +459,31 @@ void buffers_init(int argc, const char **argv, int ro)
 	}
 }
 
+/* the current buffer's kept, unless it's being re-read (or has no file) */
+static void buffers_leave(int for_n)
+{
+	if(current_buf){
+		if(current != -1 && current != for_n){
+			/* the idle flush is only of the current buffer */
+			recover_flush(current_buf);
+			lru_keep(fnames[current], current_buf);
+		}
+		else
+			buffer_free(current_buf);
+		current_buf = NULL;
+	}
+}
+
+void buffers_term()
+{
+	/* anything kept for recovery goes too */
+	buffer_free(current_buf);
+	current_buf = NULL;
+
+	while(lru_head)
+		lru_drop(lru_head);
+}
+
 int buffers_next(int n)
 {
 	if(current == -1)
@@ -202,10 +509,28 @@ int buffers_goto(int n)
 	if((loadpos = current != n))
 		buffers_save_pos();
 
+	buffers_leave(n);
+
 	last = current;
 	current = n;
-	if(current_buf)
+
+	/* a clean buffer is re-read if the file's changed, as it would be anyway */
+	if((current_buf = lru_take(fnames[n]))
+	&& !buffer_modified(current_buf) && buffer_external_modified(current_buf)){
 		buffer_free(current_buf);
+		current_buf = NULL;
+	}
+
+	if(current_buf){
+		fnames[n]->read = 1;
+		/* read ahead, maybe not all of it yet */
+		if(buffer_loading(current_buf))
+			gui_status(GUI_NONE, "%s: loading, %d%%", buffer_filename(current_buf), buffer_loaded(current_buf));
+		else
+			buffers_showinfo(current_buf, buffer_filename(current_buf));
+		goto loaded;
+	}
+
 	current_buf = buffers_readfname(fnames[current]->fname);
 
 	if(arg_ro)
@@ -213,6 +538,20 @@ int buffers_goto(int n)
 
 	fnames[n]->read = 1;
 
+	if(arg_recover){
+		int stale, nrec = recover_replay(current_buf, &stale);
+
+		if(nrec >= 0)
+			gui_status(GUI_NONE, "%s: recovered %d change%s%s", buffer_filename(current_buf),
+					nrec, nrec == 1 ? "" : "s",
+					stale ? " - but the file has changed since" : "");
+	}
+
+loaded:
+	ahead = n + 1;
+	buffers_readahead_hint();
+
+	buffer_loadto(current_buf, fnames[n]->last_y + 1);
 	gui_move(fnames[n]->last_y, 0); /* do this for checking regardless */
 	if(loadpos){
 		gui_scrollclear = 0;
@@ -229,7 +568,9 @@ int buffers_del(int n)
 	if(n < 0 || n >= count)
 		return 1;
 
+	lru_drop(fnames[n]);
 	free(fnames[n]->fname);
+	free(fnames[n]->key);
 	free(fnames[n]);
 
 	if(last == n)
@@ -239,11 +580,16 @@ int buffers_del(int n)
 		fnames[i] = fnames[i + 1];
 
 	count--;
+	buffers_rehash(hash_size); /* the indexes after n have moved */
+
 	if(current == n)
 		current = -1;
 	else if(current > n)
 		current--;
 
+	if(n < ahead)
+		ahead--;
+
 	return 0;
 }
 
@@ -257,6 +603,19 @@ int buffers_first_unread()
 	return -1;
 }
 
+int buffers_modified()
+{
+	struct old_buffer *ob;
+	int i;
+
+	for(ob = lru_head; ob; ob = ob->lru_next)
+		if(buffer_modified(ob->buf))
+			for(i = 0; i < count; i++)
+				if(fnames[i] == ob)
+					return i;
+	return -1;
+}
+
 int buffers_unread()
 {
 	return buffers_first_unread() != -1;
@@ -264,12 +623,17 @@ int buffers_unread()
 
 int buffers_find(const char *fname)
 {
-	struct old_buffer **iter;
+	char *key;
 	int i;
-	for(i = 0, iter = fnames; *iter; iter++, i++)
-		if(!strcmp((*iter)->fname, fname))
-			return i;
-	return -1;
+
+	if(!count)
+		return -1;
+
+	key = buffers_canon(fname);
+	i = hash_tab[buffers_slot(key)];
+	free(key);
+
+	return i;
 }
 
 int buffers_add(const char *fname)
@@ -279,9 +643,10 @@ int buffers_add(const char *fname)
 	if((i = buffers_find(fname)) != -1)
 		return i;
 
-	i = count++;
-	fnames        = urealloc(fnames, (count + 1) * sizeof *fnames);
-	fnames[i]     = new_old_buf(fname);
+	i = count;
+	fnames    = urealloc(fnames, (count + 2) * sizeof *fnames);
+	fnames[i] = new_old_buf(fname);
+	buffers_hashadd();
 	fnames[count] = NULL;
 
 	return i;
@@ -289,10 +654,7 @@ int buffers_add(const char *fname)
 
 int buffers_at_fname(const char *fname)
 {
-	int i = buffers_find(fname);
-	if(i == -1)
-		return 0;
-	return !strcmp(fnames[i]->fname, fname);
+	return buffers_find(fname) != -1;
 }
 
 void buffers_load(const char *fname)
@@ -308,8 +670,7 @@ void buffers_load(const char *fname)
 			buffers_goto(buffers_add(fname));
 	}else{
 		/* :new */
-		if(current_buf)
-			buffer_free(current_buf);
+		buffers_leave(-1);
 		current_buf = buffers_readfname(NULL);
 		current     = -1;
 		gui_move(0, 0);
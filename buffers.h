@@ -4,12 +4,18 @@
 struct old_buffer
 {
 	char *fname;
+	char *key; /* fname made canonical, for lookups */
 	int last_y;
 	int read;
+
+	/* kept in memory while not current, in least recently used order */
+	buffer_t *buf;
+	size_t mem;
+	struct old_buffer *lru_prev, *lru_next;
 };
 
 
-void buffers_init(int, const char **, int ro);
+void buffers_init(int, const char **, int ro, int lazy, int recover);
 void buffers_term(void);
 
 buffer_t    *buffers_current(void);
@@ -31,8 +37,12 @@ int          buffers_add(     const char *);
 void         buffers_load(    const char *);
 int          buffers_at_fname(const char *);
 
+/* carry on loading the current buffer, returns 0 once there's nothing left */
+int          buffers_idle(void);
+
 int          buffers_unread(void);
 int          buffers_first_unread(void);
+int          buffers_modified(void); /* a modified buffer that isn't current, or -1 */
 
 const char  *buffers_alternate(void);
 int          buffers_alternate_idx(void);
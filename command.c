@@ -32,6 +32,7 @@
 #include "gui/map.h"
 #include "config.h"
 #include "gui/marks.h"
+#include "journal.h"
 
 #define LEN(x) ((signed)(sizeof(x) / sizeof(x[0])))
 
@@ -116,7 +117,7 @@ void cmd_r(int argc, char **argv, int force, struct range *rng)
 
 void cmd_q(int argc, char **argv, int force, struct range *rng)
 {
-	int qa, xa;
+	int qa, xa, i;
 
 	if(argc != 1 || rng->start != -1 || rng->end != -1){
 		gui_status(GUI_ERR, "usage: q[!]");
@@ -131,6 +132,10 @@ void cmd_q(int argc, char **argv, int force, struct range *rng)
 		gui_status(GUI_ERR, "unread buffers");
 		return;
 	}
+	if(!force && (i = buffers_modified()) != -1){
+		gui_status(GUI_ERR, "\"%s\" modified since last write", buffers_array()[i]->fname);
+		return;
+	}
 	if(xa){
 		/* save current buffer */
 		char *av[] = { "x", NULL };
@@ -145,25 +150,25 @@ void cmd_w(int argc, char **argv, int force, struct range *rng)
 #define FINISH() do{ after = NONE; goto after; }while(0)
 	extern int gui_statusrestore;
 	unsigned int change_mode = 0, old_mode;
-	struct list *list_to_write = NULL;
+	struct buffer_view part, *to_write = NULL;
 	enum { QUIT, EDIT, NEXT, NONE } after = NONE;
 	int nw, nl;
 	int x = 0;
 
 	if(rng->start != -1){
-		if(--rng->start < 0)
-			rng->start = 0;
+		if(--rng->start < 0) rng->start = 0;
+		if(--rng->end   < 0) rng->end   = 0;
 
-		list_to_write = buffer_copy_range(buffers_current(), rng);
+		/* the lines are written from where they are */
+		buffer_getview(buffers_current(), rng, to_write = &part);
 
 		if(argv[0][0] == '!'){
 			char *cmd = argv_to_str(argc, argv);
 			char *bang = strchr(cmd, '!') + 1;
 
-			shellout(bang, list_to_write);
+			shellout(bang, to_write);
 
 			free(cmd);
-			list_free(list_to_write, free);
 			return;
 		}
 	}
@@ -188,8 +193,10 @@ usage:
 		/* same as above pipe, except the whole file */
 		char *cmd = argv_to_str(argc - 1, argv + 1);
 		char *bang = strchr(cmd, '!') + 1;
+		struct buffer_view all;
 
-		shellout(bang, buffer_gethead(buffers_current()));
+		buffer_getview(buffers_current(), NULL, &all);
+		shellout(bang, &all);
 
 		free(cmd);
 		FINISH();
@@ -266,10 +273,9 @@ retry:
 		/* else ignore stat error, try again and probably fail */
 	}
 
-	if(list_to_write){
-		nw = buffer_write_list(buffers_current(), list_to_write);
-		nl = list_count(list_to_write);
-		list_free(list_to_write, free);
+	if(to_write){
+		nw = buffer_write_view(buffers_current(), to_write);
+		nl = to_write->n;
 	}else{
 		nw = buffer_write(buffers_current());
 		nl = buffer_nlines(buffers_current()) - !buffer_eol(buffers_current());
@@ -290,7 +296,7 @@ retry:
 		buffer_modified(buffers_current()) = 0;
 		gui_status(GUI_NONE, "\"%s\" %s%dL, %dC written",
 				buffer_filename(buffers_current()),
-				list_to_write ? "[partial-range] ":"",
+				to_write ? "[partial-range] ":"",
 				nl, nw);
 
 		/* ensure we're on the buffer we just wrote */
@@ -321,9 +327,6 @@ after:
 		case NONE:
 			break;
 	}
-
-	if(list_to_write)
-		list_free(list_to_write, free);
 #undef FINISH
 }
 
@@ -599,6 +602,29 @@ void cmd_n(int argc, char **argv, int force, struct range *rng)
 	}
 }
 
+void cmd_earlier(int argc, char **argv, int force, struct range *rng)
+{
+	char *end;
+	int n = 1, y;
+
+	if(argc > 2 || rng->start != -1
+	|| (argc == 2 && ((n = strtol(argv[1], &end, 10)) <= 0 || (*end && strcmp(end, "f"))))){
+		gui_status(GUI_ERR, "usage: %s [count]", *argv);
+		return;
+	}
+
+	switch(journal_earlier(buffers_current(), n, &y)){
+		case -1:
+			gui_status(GUI_ERR, "buffer modified since last write");
+			break;
+		case 0:
+			gui_status(GUI_ERR, "no earlier version in the journal");
+			break;
+		default:
+			gui_move(y, 0);
+	}
+}
+
 void cmd_ls(int argc, char **argv, int force, struct range *rng)
 {
 	const int cur = buffers_idx();
@@ -685,6 +711,14 @@ perform:
 		if(n == buffers_idx())
 			MODIFIED_CHECK();
 
+		/* one that's not current may still be kept, with changes */
+		if(f == buffers_del && !force && 0 <= n && n < buffers_count()
+		&& buffers_array()[n]->buf && buffer_modified(buffers_array()[n]->buf)){
+			gui_status(GUI_ERR, "\"%s\" modified since last write", buffers_array()[n]->fname);
+			free(bufs);
+			return;
+		}
+
 		if(f(n)){
 			gui_status(GUI_ERR, "buffer index %d out of range", n);
 			return;
@@ -814,7 +848,7 @@ void cmd_help(int argc, char **argv, int force, struct range *rng)
 # include "bloat/command.c"
 #endif
 
-int shellout(const char *cmd, struct list *l)
+int shellout(const char *cmd, const struct buffer_view *v)
 {
 	int ret;
 
@@ -825,8 +859,8 @@ int shellout(const char *cmd, struct list *l)
 		fflush(stdout);
 	}
 
-	if(l){
-		if(pipe_write(cmd, l, 0) == -1){
+	if(v){
+		if(pipe_write(cmd, v, 0) == -1){
 			int e = errno;
 			gui_reload();
 			gui_status(GUI_ERR, "pipe error: %s", strerror(e));
@@ -980,6 +1014,7 @@ void command_run(char *in)
 		{ "xa", cmd_q, 1, 0 },
 
 		CMD(A,     0),
+		CMD(earlier, 1),
 		CMD(set,   0),
 		CMD(yanks, 0),
 		CMD(maps,  0),
@@ -1021,6 +1056,19 @@ void command_run(char *in)
 	if(!*in)
 		return;
 
+	if(buffer_loading(buffers_current())){
+		/* make sure the range has the lines it talks about */
+		const size_t n = strspn(in, "^$.%,-+0123456789");
+		char *p;
+
+		if(memchr(in, '$', n) || memchr(in, '%', n))
+			buffer_loadall(buffers_current());
+		else
+			for(p = in; p < in + n; p++)
+				if(isdigit(*p))
+					buffer_loadto(buffers_current(), gui_y() + strtol(p, &p, 10) + 1);
+	}
+
 	lim.start = gui_y();
 	lim.end		= buffer_nlines(buffers_current());
 
@@ -2,6 +2,6 @@
 #define COMMAND_H
 
 void command_run(char *in);
-int  shellout(const char *, struct list *);
+int  shellout(const char *, const struct buffer_view *); /* NULL, or lines for its stdin */
 
 #endif
@@ -10,4 +10,4 @@ CC      = cc
 CFLAGS  = -g -Wall -Wextra -pedantic -std=c99 ${MACROS} ${WARN_EXTRA} -DUVI_VERSION=\"${VERSION}\"
 
 LD      = cc
-LDFLAGS = -g -lncurses
+LDFLAGS = -g -lncurses -lpthread
@@ -25,3 +25,30 @@ const char *file_info(void)
 {
 	return file_generic("info");
 }
+
+const char *file_index(unsigned long long dev, unsigned long long ino)
+{
+	static char fname[256 + 40];
+
+	snprintf(fname, sizeof fname, "%s/%llx.%llx", file_generic("index"), dev, ino);
+
+	return fname;
+}
+
+const char *file_journal(unsigned long long key)
+{
+	static char fname[256 + 20];
+
+	snprintf(fname, sizeof fname, "%s/%llx", file_generic("journal"), key);
+
+	return fname;
+}
+
+const char *file_recover(unsigned long long key)
+{
+	static char fname[256 + 20];
+
+	snprintf(fname, sizeof fname, "%s/%llx", file_generic("recover"), key);
+
+	return fname;
+}
@@ -3,5 +3,8 @@
 
 const char *file_rc(void);
 const char *file_info(void);
+const char *file_index(unsigned long long dev, unsigned long long ino);
+const char *file_journal(unsigned long long key);
+const char *file_recover(unsigned long long key);
 
 #endif
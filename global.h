@@ -12,6 +12,7 @@ struct settings
 
 	int ignorecase;
 	int smartcase;
+	int nativere;
 
 	int hls;
 	int syn;
@@ -24,6 +25,14 @@ struct settings
 
 	int fsync;
 	int esctrim;
+	int lazy;
+	int index;
+	int undomem;
+	int journal;
+	int recover;
+	int bufmem;
+	int readahead;
+	int intern;
 
 	int read_info;
 };
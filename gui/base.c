@@ -27,6 +27,7 @@
 #include "map.h"
 #include "../buffers.h"
 #include "../util/search.h"
+#include "../undo.h"
 #include "extra.h"
 
 #define REPEAT_FUNC(nam) static void nam(unsigned int)
@@ -55,7 +56,7 @@ static int  yank_char = YANK_CHAR_ANON;
 
 static int search(int next, int rev)
 {
-	const char *(*usearch_func)(struct usearch *, const char *, int);
+	const char *(*usearch_func)(struct usearch *, const char *, int, int);
 	struct list *l;
 	const char *p;
 	int y;
@@ -91,8 +92,7 @@ static int search(int next, int rev)
 	/* TODO: allow SIGINT to stop search? */
 	usearch_func = rev ? usearch_rev : usearch;
 
-	offset = gui_x() + (rev ? -1 : 1);
-	if(offset < 0) offset = 0;
+	offset = gui_x() + (rev ? -1 : 1); /* -1 finds nothing before the cursor */
 	setoffset = 0;
 
 	y = gui_y();
@@ -103,9 +103,9 @@ static int search(int next, int rev)
 			){
 
 		if(setoffset)
-			offset = rev ? strlen(l->data) : 0;
+			offset = rev ? buffer_line_len(l) : 0;
 
-		if((p = usearch_func(&us, (const char *)l->data, offset))){
+		if((p = usearch_func(&us, (const char *)l->data, buffer_line_len(l), offset))){
 			int x = p - (char *)l->data;
 			found = 1;
 			gui_move(y, x);
@@ -113,6 +113,10 @@ static int search(int next, int rev)
 			break;
 		}
 
+		if(!rev && !l->next)
+			/* only as much as we need to search */
+			buffer_loadmore(buffers_current());
+
 		setoffset = 1;
 	}
 
@@ -180,6 +184,54 @@ void shiftline(char **ps, int indent)
 fin:;
 }
 
+/* shiftline(), in place - what's after the indent isn't copied, and may have '\0's */
+static void shiftbufline(buffer_t *b, struct list *l, int indent)
+{
+	const char *s = l->data;
+	const int len = buffer_line_len(l);
+	int n;
+
+	for(n = 0; n < len && (s[n] == ' ' || s[n] == '\t'); n++);
+	if(n == len){
+		if(len)
+			buffer_line_delete(b, l, 0, len);
+		return;
+	}
+
+	if(indent > 0){
+		char *ws;
+
+		if(global_settings.et)
+			indent *= global_settings.tabstop;
+
+		ws = umalloc(indent);
+		memset(ws, global_settings.et ? ' ' : '\t', indent);
+		buffer_line_insert(b, l, 0, ws, indent);
+		free(ws);
+		return;
+	}
+
+	for(n = 0; indent++ < 0; ){
+		int i;
+
+		if(s[n] == '\t'){
+			n++;
+			continue;
+		}
+
+		/* ensure we can unindent by global_settings.tabstop spaces */
+		for(i = 0; i < global_settings.tabstop && n + i < len; i++)
+			if(s[n + i] != ' ')
+				break;
+		if(i < global_settings.tabstop)
+			break;
+		n += i;
+	}
+
+	if(n)
+		buffer_line_delete(b, l, 0, n);
+}
+
 void shift(int repeat)
 {
 	struct list *l;
@@ -191,7 +243,7 @@ void shift(int repeat)
 
 	l = buffer_getindex(buffers_current(), y1);
 	while(y1++ <= y2 && l){
-		shiftline((char **)&l->data, repeat);
+		shiftbufline(buffers_current(), l, repeat);
 		l = l->next;
 	}
 
@@ -203,34 +255,39 @@ void replace(unsigned int n)
 {
 	int c;
 	struct list *cur = buffer_getindex(buffers_current(), gui_y());
-	char *s = cur->data;
+	const int len = buffer_line_len(cur);
+	char *s;
 
-	if(!*s)
+	if(!len)
 		return;
 
 	if(n <= 0)
 		n = 1;
-	else if(n > strlen(s + gui_x()))
+	else if((signed)n > buffer_line_len(cur) - gui_x())
 		return;
 
 	c = gui_getch(GETCH_RAW);
 
 	if(c == '\n'){
-		/* delete n chars, and insert 1 line */
-		char *off = s + gui_x() + n-1;
-		char *cpy = umalloc(strlen(off));
+		/* delete n chars, and insert 1 line - with lengths, as there may be '\0's */
+		const int x = gui_x(), ncpy = len - x - n;
+		char *cpy = umalloc(ncpy + 1);
 
-		memset(off - n + 1, '\0', n);
-		strcpy(cpy, off + 1);
+		memcpy(cpy, (char *)cur->data + x + n, ncpy + 1);
+		buffer_line_delete(buffers_current(), cur, x, len - x);
 
-		buffer_insertafter(buffers_current(), cur, cpy);
+		buffer_insertafter_len(buffers_current(), cur, cpy, ncpy);
 
 		gui_move(gui_y() + 1, 0);
 	}else if(c != CTRL_AND('[')){
 		int x = gui_x();
 
+		buffer_line_edit(buffers_current(), cur);
+		s = cur->data;
+
 		while(n--)
 			s[x + n] = c;
+		buffer_line_changed(buffers_current(), cur, len);
 	}
 
 	buffer_modified(buffers_current()) = 1;
@@ -378,8 +435,17 @@ static void trim_buffer(void)
 
 	buffer_modified(cb) = 1;
 
-	for(l = buffer_gethead(cb); l; l = l->next)
-		str_rtrim(l->data);
+	for(l = buffer_gethead(cb); l; l = l->next){
+		const char *s = l->data;
+		const int len = buffer_line_len(l);
+		int n = len;
+
+		while(n > 0 && isspace(s[n - 1]))
+			n--;
+
+		if(n < len)
+			buffer_line_delete(cb, l, n, len - n);
+	}
 }
 
 static void insert(int append, int do_indent, int trim_initial)
@@ -400,33 +466,37 @@ static void insert(int append, int do_indent, int trim_initial)
 
 	{
 		struct list *iter = buffer_getindex(buffers_current(), gui_y());
-		char *ins;
-		char *after;
-
-		ins = (char *)iter->data + x;
-		after = ustrdup(ins);
-		*ins = '\0';
 
 		if(i > 1){
-			/* add all lines, then join with v_after */
-			int j;
+			/* add all lines, then join with v_after - which may have '\0's */
+			const int len = buffer_line_len(iter), nlast = strlen(lines[i-1]);
+			char *last;
+			int nafter, j;
 
-			ustrcat((char **)&iter->data, NULL, *lines, NULL);
+			if(x > len)
+				x = len;
+			nafter = len - x;
 
 			/* tag v_after onto the last line */
-			ustrcat(&lines[i-1], NULL, after, NULL);
+			last = umalloc(nlast + nafter + 1);
+			memcpy(last, lines[i-1], nlast);
+			memcpy(last + nlast, (char *)iter->data + x, nafter + 1);
+			free(lines[i-1]);
+
+			buffer_line_delete(buffers_current(), iter, x, nafter);
+			buffer_line_insert(buffers_current(), iter, x, *lines, strlen(*lines));
 
-			for(j = i - 1; j > 0; j--)
+			buffer_insertafter_len(buffers_current(), iter, last, nlast + nafter);
+			for(j = i - 2; j > 0; j--)
 				buffer_insertafter(buffers_current(), iter, lines[j]);
 
-			gui_move(gui_y() + i - 1, strlen(after) + strlen(lines[i-1]));
+			gui_move(gui_y() + i - 1, nafter + nlast + nafter);
 		}else{
-			/* tag v_after on the end */
-			ustrcat((char **)&iter->data, NULL, *lines, after, NULL);
+			/* in place, without copying what's after x */
+			buffer_line_insert(buffers_current(), iter, x, *lines, strlen(*lines));
 			gui_move(gui_y(), gui_x() + strlen(*lines) - !append); /* if append, no need to hopback */
 		}
 		free(*lines);
-		free(after);
 	}
 
 	buffer_modified(buffers_current()) = 1;
@@ -454,12 +524,16 @@ void overwrite()
 
 	readlines(0 /* indent */, 0, &opts, &lines, &nl);
 
-	if(strlen(*lines) > strlen(iter->data))
-		/* need to extend iter->data */
-		iter->data = urealloc(iter->data, strlen(iter->data) + strlen(*lines) + 1 /* plenty */);
-
-	/* don't copy the nul byte */
-	strncpy((char *)iter->data + start_x, *lines, strlen(*lines));
+	{
+		const int len = buffer_line_len(iter), n = strlen(*lines);
+		char *data = buffer_line_reserve(buffers_current(), iter, n);
+
+		/* don't copy the nul byte, unless we're going past the end */
+		memcpy(data + start_x, *lines, n);
+		if(start_x + n > len)
+			data[start_x + n] = '\0';
+		buffer_line_changed(buffers_current(), iter, start_x + n > len ? start_x + n : len);
+	}
 
 	/* FIXME? if nl>0, instead of discarding *(iter->data + startx + strlen(*lines))..., tag it onto the end? */
 
@@ -496,7 +570,7 @@ static void open(int before)
 
 static void motion_cmd(struct motion *motion,
 		void (*f_line )(struct range *),
-		void (*f_range)(char *data, int startx, int endx)
+		void (*f_range)(struct list *l, int startx, int endx)
 		)
 {
 	struct bufferpos topos;
@@ -541,7 +615,7 @@ static void motion_cmd(struct motion *motion,
 			for(ystart = from.start, lp = buffer_getindex(buffers_current(), ystart);
 					ystart <= yend;
 					ystart++, lp = lp->next)
-				f_range(lp->data, xstart, xend);
+				f_range(lp, xstart, xend);
 #undef ystart
 #undef yend
 #undef xstart2
@@ -553,7 +627,7 @@ static void motion_cmd(struct motion *motion,
 				f_line(&from);
 				gui_move_sol(from.start);
 			}else{
-				char *data = buffer_getindex(buffers_current(), gui_y())->data;
+				struct list *l = buffer_getindex(buffers_current(), gui_y());
 				int startx = gui_x();
 
 				if(from.start < from.end){
@@ -579,7 +653,7 @@ static void motion_cmd(struct motion *motion,
 							break;
 					}
 
-					f_range(data, startx, x);
+					f_range(l, startx, x);
 				}
 
 				gui_move(gui_y(), startx);
@@ -590,32 +664,34 @@ static void motion_cmd(struct motion *motion,
 
 static void delete_line(struct range *from)
 {
-	struct list *l = buffer_extract_range(buffers_current(), from);
+	struct list *l = buffer_extract_range_shared(buffers_current(), from);
 	yank_set_list(yank_char, l);
 	gui_move(gui_y(), gui_x());
 	buffer_modified(buffers_current()) = 1;
 }
-static void delete_range(char *data, int startx, int x)
+static void delete_range(struct list *l, int startx, int x)
 {
 	int len = x - startx;
 	char *dup = umalloc(len + 1);
-	strncpy(dup, data + startx, len);
+
+	strncpy(dup, (char *)l->data + startx, len);
 	dup[len] = '\0';
 	yank_set_str(yank_char, dup);
 
 	/* remove the chars between startx and x, inclusive */
 	if(len == 0)
 		x++; /* fix for 'x' at eol */
-	memmove(data + startx, data + x, strlen(data + x) + 1);
+	buffer_line_delete(buffers_current(), l, startx, x - startx);
 	buffer_modified(buffers_current()) = 1;
 }
 
 static void yank_line(struct range *from)
 {
-	yank_set_list(yank_char, buffer_copy_range(buffers_current(), from));
+	yank_set_list(yank_char, buffer_share_range(buffers_current(), from));
 }
-static void yank_range(char *data, int startx, int x)
+static void yank_range(struct list *l, int startx, int x)
 {
+	char *data = l->data;
 	int len = x - startx;
 	char *dup = umalloc(len + 1);
 
@@ -673,34 +749,19 @@ static void put(unsigned int ntimes, int rev)
 
 
 	if(ynk->is_list){
-#define INS(f) \
-		f( \
-			buffers_current(), \
-			buffer_getindex(buffers_current(), gui_y()), \
-			list_copy(ynk->v, (void *(*)(void *))ustrdup) \
-		)
-
+		/* the lines are shared with the register, until either changes them */
 		if(rev)
-			INS(buffer_insertlistbefore);
+			buffer_sharelistbefore(buffers_current(), buffer_getindex(buffers_current(), gui_y()), ynk->v);
 		else
-			INS(buffer_insertlistafter);
+			buffer_sharelistafter(buffers_current(), buffer_getindex(buffers_current(), gui_y()), ynk->v);
 
 		gui_move(gui_y() + (rev ? 0 : list_count(ynk->v)), gui_x());
 
 	}else{
 		struct list *l = buffer_getindex(buffers_current(), gui_y());
 		const int x = gui_x() + 1 - rev;
-		char *data = l->data;
-		char *after = ALLOCA(strlen(data + x) + 1);
-		char *new;
-
-		strcpy(after, data + x);
-		data[x] = '\0';
-
-		new = ustrprintf("%s%s%s", data, (char *)ynk->v, after);
 
-		free(l->data);
-		l->data = new;
+		buffer_line_insert(buffers_current(), l, x, ynk->v, strlen(ynk->v));
 
 		gui_move(gui_y(), x + strlen(ynk->v) - 1);
 	}
@@ -710,12 +771,17 @@ static void put(unsigned int ntimes, int rev)
 
 static void join(unsigned int ntimes)
 {
-	struct list *jointhese, *l, *cur;
+	struct list *l, *cur;
 	struct range r;
+	char *data, *end;
 	int len, initial_len;
+	unsigned int i;
 
 	{
-		unsigned int nl = buffer_nlines(buffers_current());
+		unsigned int nl;
+
+		buffer_loadto(buffers_current(), gui_y() + ntimes + 2);
+		nl = buffer_nlines(buffers_current());
 		if(nl <= 1 || gui_y() + ntimes >= nl - 1){
 			gui_status(GUI_ERR, "can't join %d line%s", ntimes,
 					ntimes == 1 ? "" : "s");
@@ -728,29 +794,57 @@ static void join(unsigned int ntimes)
 	r.start = gui_y() + 1; /* extract the next line(s) */
 	r.end   = r.start + ntimes;
 
-	jointhese = buffer_extract_range(buffers_current(), &r);
-
 	len = 0;
-	for(l = jointhese; l; l = l->next){
-		str_trim(l->data);
-		len += strlen(l->data) + (*(char *)l->data ? 1 : 0);
-	}
-
-	initial_len = strlen(cur->data);
-	cur->data = urealloc(cur->data, initial_len + len + 1);
-
-	for(l = jointhese; l; l = l->next){
-		if(*(char *)cur->data)
-			strcat(cur->data, " ");
-		strcat(cur->data, l->data);
+	for(i = 0, l = cur->next; i <= ntimes; i++, l = l->next)
+		len += buffer_line_len(l) + 1;
+
+	initial_len = buffer_line_len(cur);
+	data = buffer_line_reserve(buffers_current(), cur, len);
+
+	/*
+	 * appended in place, rather than strcat() rescanning each time, and
+	 * trimmed by length, since the lines may have '\0's in them
+	 */
+	for(end = data + initial_len, i = 0, l = cur->next; i <= ntimes; i++, l = l->next){
+		const char *s = l->data;
+		int n = buffer_line_len(l);
+
+		for(; n > 0 && isspace(*s); s++, n--);
+		for(; n > 0 && isspace(s[n - 1]); n--);
+
+		if(end > data && n)
+			*end++ = ' ';
+		memcpy(end, s, n);
+		end += n;
 	}
+	*end = '\0';
+	buffer_line_changed(buffers_current(), cur, end - data);
 
-	list_free(jointhese, free);
+	buffer_remove_range(buffers_current(), &r);
 
 	gui_move(gui_y(), initial_len);
 	buffer_modified(buffers_current()) = 1;
 }
 
+static void undoredo(int redo, unsigned int ntimes)
+{
+	int (*f)(buffer_t *, int *, int *) = redo ? undo_redo : undo_undo;
+	int y, x;
+	unsigned int i;
+
+	if(!ntimes)
+		ntimes = 1;
+
+	for(i = 0; i < ntimes; i++)
+		if(f(buffers_current(), &y, &x))
+			break;
+
+	if(i)
+		gui_move(y, x);
+	if(i < ntimes)
+		gui_status(GUI_ERR, "nothing%s to %s", i ? " more" : "", redo ? "redo" : "undo");
+}
+
 static void colon(const char *initial)
 {
 	struct gui_read_opts opts;
@@ -884,6 +978,8 @@ static int is_edit_char(int c)
 		case '~':
 		case 'p':
 		case 'P':
+		case 'u':
+		case CTRL_AND('r'):
 			return 1;
 	}
 	return 0;
@@ -920,6 +1016,9 @@ void gui_run()
 		int flag = 0, resetmultiple = 1;
 		int c;
 
+		/* each command is undone as a whole */
+		undo_break(buffers_current());
+
 		if(buffer_changed){
 			buffer_changed = 0;
 			view_changed = 1;
@@ -1233,6 +1332,12 @@ case_i:
 				buffer_changed = 1;
 				break;
 
+			case 'u':
+			case CTRL_AND('r'):
+				undoredo(c == CTRL_AND('r'), multiple);
+				buffer_changed = 1;
+				break;
+
 			case 'K':
 				showgirl(multiple);
 				break;
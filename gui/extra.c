@@ -44,15 +44,20 @@ int fmt_motion()
 
 void tilde(unsigned int rep)
 {
-	char *data = (char *)buffer_getindex(buffers_current(), gui_y())->data;
-	char *pos = data + gui_x();
+	struct list *l = buffer_getindex(buffers_current(), gui_y());
+	const int len = buffer_line_len(l);
+	char *pos, *end;
+
+	buffer_line_edit(buffers_current(), l);
+	pos = (char *)l->data + gui_x();
+	end = (char *)l->data + len;
 
 	if(!rep)
 		rep = 1;
 
 	gui_move(gui_y(), gui_x() + rep);
 
-	while(rep --> 0){
+	while(pos < end && rep --> 0){
 		if(islower(*pos))
 			*pos = toupper(*pos);
 		else
@@ -60,10 +65,11 @@ void tilde(unsigned int rep)
 
 		/* *pos ^= (1 << 5); * flip bit 100000 = 6 */
 
-		if(!*++pos)
-			break;
+		++pos;
 	}
 
+	buffer_line_changed(buffers_current(), l, len);
+
 	buffer_modified(buffers_current()) = 1;
 }
 
@@ -22,6 +22,7 @@
 #include "macro.h"
 #include "marks.h"
 #include "../buffers.h"
+#include "../recover.h"
 #include "../yank.h"
 #include "../util/search.h"
 #include "syntax.h"
@@ -302,6 +303,41 @@ void gui_setyx(int y, int x)
 	move(y, x);
 }
 
+/* getch(), loading the current buffer (then the next files) while there's no input */
+static int gui_getch_idle(void)
+{
+	int c;
+
+	if(recover_pending(buffers_current())){
+		/* log recent changes once there's a pause */
+		timeout(global_settings.recover);
+		c = getch();
+		timeout(-1);
+
+		if(c != ERR)
+			return c;
+		recover_flush(buffers_current());
+	}
+
+	nodelay(stdscr, TRUE);
+	while((c = getch()) == ERR && buffers_idle()){
+		if(buffer_loading(buffers_current()) && buffer_nlines(buffers_current()) <= pos_top + LINES)
+			/* we've got more of the screen to show */
+			gui_draw();
+		refresh();
+	}
+	nodelay(stdscr, FALSE);
+
+	if(c == ERR){
+		/* loading can log changes too - the '\r's put back, if it's not crlf after all */
+		if(recover_pending(buffers_current()))
+			recover_flush(buffers_current());
+		refresh();
+		c = getch();
+	}
+	return c;
+}
+
 int gui_getch(enum getch_opt o)
 {
 	int c;
@@ -310,7 +346,7 @@ restart:
 	refresh();
 
 	if(unget_i == 0){
-		c = getch();
+		c = gui_getch_idle();
 		if(c == '\r')
 			c = '\n';
 	}else{
@@ -639,7 +675,7 @@ void gui_draw()
 			attron(A_REVERSE);
 
 		if(hls_ing)
-			hls = usearch(&us, l->data, 0);
+			hls = usearch(&us, l->data, buffer_line_len(l), 0);
 		else
 			hls = NULL;
 
@@ -656,7 +692,7 @@ check_search:
 					gui_attroff(GUI_SEARCH_COL);
 
 					/* //g */
-					hls = usearch(&us, p, 0);
+					hls = usearch(&us, l->data, buffer_line_len(l), p - (char *)l->data);
 					if(hls)
 						goto check_search;
 				}
@@ -821,18 +857,22 @@ void gui_inc_cursor()
 
 void gui_move(int y, int x)
 {
+	struct list *l;
 	const char *line;
 	int len;
 
+	buffer_loadto(buffers_current(), y + 1);
+
 	if(y < 0)
 		y = 0;
 	else if(y >= buffer_nlines(buffers_current()))
 		y = buffer_nlines(buffers_current())-1;
 
 	/* check that we're on the right x pos - ^I etc */
-	line = buffer_getindex(buffers_current(), y)->data;
+	l = buffer_getindex(buffers_current(), y);
+	line = l->data;
 
-	len = strlen(line) - 1;
+	len = buffer_line_len(l) - 1;
 	if(len < 0)
 		len = 0;
 
@@ -870,7 +910,10 @@ void gui_move_sol(int y)
 
 void gui_inc(int n)
 {
-	int nl = buffer_nlines(buffers_current());
+	int nl;
+
+	buffer_loadto(buffers_current(), pos_y + n + 1);
+	nl = buffer_nlines(buffers_current());
 
 	if(pos_y < nl - 1){
 		pos_y += n;
@@ -921,6 +964,9 @@ int gui_scroll(enum scroll s)
 	int check = 0;
 	int ret = 0;
 
+	/* a screen past wherever we could scroll to */
+	buffer_loadto(buffers_current(), pos_top + 3 * LINES);
+
 	switch(s){
 		case SINGLE_DOWN:
 			if(pos_top < buffer_nlines(buffers_current()) - 1 - global_settings.scrolloff){
@@ -292,7 +292,10 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 
 		case MOTION_DOWN:
 		{
-			int nlines = buffer_nlines(buffers_current());
+			int nlines;
+
+			buffer_loadto(buffers_current(), *pos->y + 2);
+			nlines = buffer_nlines(buffers_current());
 
 			if(nlines < 0)
 				nlines = 0;
@@ -460,7 +463,7 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 					break;
 				if(!global_settings.func_motion_vi){
 					/* /^[^\s].*{\s*$/ */
-					int len = strlen(l->data);
+					int len = buffer_line_len(l);
 					if(!isspace(*(char *)l->data)){
 						int i = len - 1;
 						while(i > 0 && isspace(((char *)l->data)[i]))
@@ -481,7 +484,7 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 			if(global_settings.func_motion_vi)
 				*pos->x = 0;
 			else
-				*pos->x = l ? strlen(l->data) - 1 : 0;
+				*pos->x = l ? buffer_line_len(l) - 1 : 0;
 
 			return 0;
 		}
@@ -491,6 +494,7 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 				/* go a percentage way through the file */
 				int y, nl;
 
+				buffer_loadall(buffers_current());
 				nl = buffer_nlines(buffers_current());
 				y  = (float)nl * (float)motion->ntimes / 100.0f;
 
@@ -518,6 +522,7 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 			if(motion->ntimes > 1)
 				goto motion_goto;
 
+			buffer_loadall(buffers_current());
 			last = buffer_nlines(buffers_current()) - 1;
 			if(last < 0)
 				last = 0;
@@ -531,6 +536,8 @@ int motion_apply2(const struct motion *motion, struct bufferpos *pos,
 motion_goto:
 	{
 		int y = motion->ntimes - 1;
+
+		buffer_loadto(buffers_current(), motion->ntimes);
 		if(y < 0)
 			y = 0;
 		else if(y >= buffer_nlines(buffers_current()))
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -14,6 +15,7 @@
 #include "yank.h"
 #include "util/io.h"
 #include "util/alloc.h"
+#include "util/str.h"
 #include "global.h"
 
 #define info_open(m) fopen(file_info(), m)
@@ -60,7 +62,7 @@ check:
 								break; /* ignore */
 
 							if(*line == '\t')
-								list_append(y, ustrdup(line + 1));
+								list_append(y, str_share(line + 1, strlen(line + 1)));
 							else
 								break;
 						}
@@ -68,7 +70,7 @@ check:
 						if(list_count(y))
 							yank_set_list(c, y);
 						else
-							list_free(y, free);
+							list_free(y, str_unref);
 
 						if(line)
 							goto check; /* don't discard the current line */
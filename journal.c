@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util/alloc.h"
+#include "range.h"
+#include "util/list.h"
+#include "buffer.h"
+#include "global.h"
+#include "files.h"
+#include "util/str.h"
+#include "journal.h"
+
+/*
+ * a journal is keyed by a hash of the file's full path, and starts with
+ * that path. then, one record per write: the lines the write replaced,
+ * and hashes of the file before and after, which chain the records
+ * together. only the old side is kept - the newest is the file itself
+ */
+#define JOURNAL_MAGIC "uvj\001"
+#define RECORD_MAGIC  "uvjr"
+
+struct journal_head
+{
+	char magic[4];
+	unsigned int pathlen;
+	/* char path[pathlen]; */
+};
+
+struct record
+{
+	char magic[4];
+	unsigned int len; /* of the old text, which follows */
+	unsigned long long oldhash, newhash, newsize;
+	long long newmtime, when;
+	int start, nold, nnew; /* lines [start, start + nnew) were nold lines */
+	int oldeol; /* -1 if the file was empty */
+};
+
+struct journal_write
+{
+	struct record rec;
+	char *text;
+};
+
+/* a buffer's mapped journal */
+struct journal
+{
+	char *map;
+	size_t size;
+	size_t *recs; /* offsets */
+	int nrecs;
+	int pos; /* the buffer holds what recs[pos] replaced - or the file, if pos == nrecs */
+	unsigned long gen; /* b->gen when pos was right */
+};
+
+static const char *journal_file(const char *path)
+{
+	return file_journal(str_hash(STR_HASH_INIT, path, strlen(path)));
+}
+
+/* fill in w - how the buffer differs from old, the file's current contents */
+static void journal_diff(buffer_t *b, const char *old, size_t olen, struct journal_write *w)
+{
+	const char *const nl = buffer_crlf(b) ? "\r\n" : "\n";
+	const size_t nllen = strlen(nl);
+	const int nlines = buffer_nlines(b);
+	struct list *l;
+	unsigned long long h = STR_HASH_INIT;
+	size_t p = 0, s = 0, i;
+	int start = 0, nsuffix = 0;
+
+	/* as buffer_fwrite() will write it */
+	for(l = buffer_gethead(b); l; l = l->next){
+		h = str_hash(h, l->data, buffer_line_len(l));
+		if(l->next || buffer_eol(b))
+			h = str_hash(h, nl, nllen);
+	}
+	w->rec.newhash = h;
+	w->rec.oldhash = str_hash(STR_HASH_INIT, old, olen);
+
+	if(w->rec.newhash == w->rec.oldhash)
+		return;
+
+	/* lines the same at the start */
+	for(l = buffer_gethead(b); l; l = l->next, start++){
+		const size_t len = buffer_line_len(l);
+		const size_t n = l->next || buffer_eol(b) ? nllen : 0;
+
+		if(olen - p < len + n || (!n && olen - p != len)
+		|| memcmp(old + p, l->data, len) || memcmp(old + p + len, nl, n))
+			break;
+		p += len + n;
+	}
+
+	/* and at the end */
+	for(l = buffer_gettail(b); nlines - nsuffix > start; l = l->prev, nsuffix++){
+		const size_t len = buffer_line_len(l);
+		const size_t n = l->next || buffer_eol(b) ? nllen : 0;
+		size_t at;
+
+		/* an empty last line could be taken either way */
+		if(!len && !n)
+			break;
+		if(olen - p - s < len + n)
+			break;
+
+		at = olen - s - len - n;
+		if((at > p && old[at - 1] != '\n')
+		|| memcmp(old + at, l->data, len) || memcmp(old + at + len, nl, n))
+			break;
+		s += len + n;
+	}
+
+	w->rec.start = start;
+	w->rec.nnew = nlines - start - nsuffix;
+	w->rec.len = olen - s - p;
+	w->rec.oldeol = olen ? old[olen - 1] == '\n' : -1;
+
+	w->text = umalloc(w->rec.len + 1);
+	memcpy(w->text, old + p, w->rec.len);
+
+	for(i = 0; i < w->rec.len; i++)
+		if(w->text[i] == '\n')
+			w->rec.nold++;
+	if(!s && w->rec.len && w->text[w->rec.len - 1] != '\n')
+		w->rec.nold++;
+}
+
+struct journal_write *journal_before(buffer_t *b)
+{
+	struct journal_write *w;
+	struct stat st;
+	char *old = NULL;
+	int fd;
+
+	if(!global_settings.journal || !buffer_hasfilename(b))
+		return NULL;
+
+	memset(&st, '\0', sizeof st);
+
+	if((fd = open(buffer_filename(b), O_RDONLY)) != -1){
+		if(fstat(fd, &st) || !S_ISREG(st.st_mode)
+		|| (st.st_size && (old = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)){
+			close(fd);
+			return NULL;
+		}
+		close(fd);
+	}else if(errno != ENOENT){
+		return NULL;
+	}
+
+	w = umalloc(sizeof *w);
+	memset(w, '\0', sizeof *w);
+	memcpy(w->rec.magic, RECORD_MAGIC, sizeof w->rec.magic);
+
+	/* before the write truncates it */
+	journal_diff(b, old ? old : "", st.st_size, w);
+
+	if(old)
+		munmap(old, st.st_size);
+
+	return w;
+}
+
+static void journal_append(const char *path, const struct record *rec, const char *text)
+{
+	const char *jname = journal_file(path);
+	char *dir = ustrdup(jname);
+	struct stat st;
+	FILE *f;
+
+	*strrchr(dir, '/') = '\0';
+	mkdir(dir, 0700); /* may well exist */
+	free(dir);
+
+	if(!(f = fopen(jname, "a")))
+		return;
+
+	if(fstat(fileno(f), &st) == 0 && st.st_size == 0){
+		struct journal_head head;
+
+		memcpy(head.magic, JOURNAL_MAGIC, sizeof head.magic);
+		head.pathlen = strlen(path);
+		fwrite(&head, sizeof head, 1, f);
+		fwrite(path, 1, head.pathlen, f);
+	}
+
+	/* a torn record is ignored when the journal's read */
+	fwrite(rec, sizeof *rec, 1, f);
+	fwrite(text, 1, rec->len, f);
+	fclose(f);
+}
+
+void journal_after(buffer_t *b, struct journal_write *w, int written)
+{
+	struct stat st;
+	char *path;
+
+	if(!w)
+		return;
+
+	if(written && w->text
+	&& stat(buffer_filename(b), &st) == 0
+	&& (path = realpath(buffer_filename(b), NULL))){
+		w->rec.newsize  = st.st_size;
+		w->rec.newmtime = st.st_mtime;
+		w->rec.when     = time(NULL);
+
+		journal_append(path, &w->rec, w->text);
+		free(path);
+	}
+
+	/* the file's changed under any mapping we had */
+	journal_free(b->journal);
+	b->journal = NULL;
+
+	free(w->text);
+	free(w);
+}
+
+static void journal_rec(struct journal *j, int i, struct record *rec)
+{
+	memcpy(rec, j->map + j->recs[i], sizeof *rec);
+}
+
+static struct journal *journal_map(buffer_t *b)
+{
+	struct journal_head head;
+	struct journal *j;
+	struct stat st, jst;
+	char *path;
+	size_t off;
+	int fd;
+
+	if(!buffer_hasfilename(b)
+	|| stat(buffer_filename(b), &st)
+	|| !(path = realpath(buffer_filename(b), NULL)))
+		return NULL;
+
+	fd = open(journal_file(path), O_RDONLY);
+
+	j = umalloc(sizeof *j);
+	memset(j, '\0', sizeof *j);
+
+	if(fd == -1 || fstat(fd, &jst) || (size_t)jst.st_size < sizeof head
+	|| (j->map = mmap(NULL, jst.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		j->map = NULL;
+		goto bail;
+	}
+	j->size = jst.st_size;
+
+	memcpy(&head, j->map, sizeof head);
+	off = sizeof head + head.pathlen;
+	if(memcmp(head.magic, JOURNAL_MAGIC, sizeof head.magic)
+	|| head.pathlen != strlen(path) || off > j->size
+	|| memcmp(j->map + sizeof head, path, head.pathlen))
+		goto bail;
+
+	while(j->size - off >= sizeof(struct record)){
+		struct record rec;
+
+		memcpy(&rec, j->map + off, sizeof rec);
+		if(memcmp(rec.magic, RECORD_MAGIC, sizeof rec.magic)
+		|| rec.len > j->size - off - sizeof rec)
+			break;
+
+		if(j->nrecs % 32 == 0)
+			j->recs = urealloc(j->recs, (j->nrecs + 32) * sizeof *j->recs);
+		j->recs[j->nrecs++] = off;
+
+		off += sizeof rec + rec.len;
+	}
+
+	if(j->nrecs){
+		struct record last;
+
+		/* only if the file is as the last write left it */
+		journal_rec(j, j->nrecs - 1, &last);
+		if(last.newsize == (unsigned long long)st.st_size && last.newmtime == (long long)st.st_mtime)
+			j->pos = j->nrecs;
+	}
+
+bail:
+	if(fd != -1)
+		close(fd);
+	free(path);
+	return j;
+}
+
+void journal_free(struct journal *j)
+{
+	if(j){
+		if(j->map)
+			munmap(j->map, j->size);
+		free(j->recs);
+		free(j);
+	}
+}
+
+/* put back the lines rec replaced */
+static int journal_apply(buffer_t *b, const struct record *rec, const char *text)
+{
+	const char *const end = text + rec->len;
+	struct list *l, *tail;
+	int i;
+
+	buffer_loadto(b, rec->start + rec->nnew + 1);
+	if(rec->start + rec->nnew > buffer_nlines(b))
+		return 1;
+
+	if(rec->nold){
+		/* shared, so the lines keep their lengths - they may have '\0's */
+		tail = l = list_new(NULL);
+		for(i = 0; i < rec->nold; i++){
+			const char *nl = memchr(text, '\n', end - text);
+			const char *eol = nl ? nl : end;
+
+			if(buffer_crlf(b) && eol > text && eol[-1] == '\r')
+				eol--;
+
+			list_append(tail, str_share(text, eol - text));
+			tail = list_gettail(tail);
+			text = nl ? nl + 1 : end;
+		}
+
+		/* in first, so the buffer is never left empty */
+		if(rec->start < buffer_nlines(b))
+			buffer_sharelistbefore(b, buffer_getindex(b, rec->start), l);
+		else
+			buffer_sharelistafter(b, buffer_gettail(b), l);
+		list_free(l, str_unref);
+	}
+
+	if(rec->nnew){
+		struct range r;
+
+		r.start = rec->start + rec->nold;
+		r.end   = r.start + rec->nnew - 1;
+		buffer_remove_range(b, &r);
+	}
+
+	if(rec->oldeol != -1)
+		buffer_eol(b) = rec->oldeol;
+
+	return 0;
+}
+
+int journal_earlier(buffer_t *b, int n, int *y)
+{
+	struct journal *j = b->journal;
+	int i;
+
+	if(!j || j->gen != b->gen){
+		journal_free(j);
+		b->journal = NULL;
+
+		if(buffer_modified(b) || buffer_external_modified(b))
+			return -1;
+		if(!(j = b->journal = journal_map(b)))
+			return 0;
+	}
+
+	for(i = 0; i < n && j->pos > 0; i++){
+		struct record rec;
+
+		journal_rec(j, j->pos - 1, &rec);
+
+		if(j->pos < j->nrecs){
+			struct record after;
+
+			/* a break in the chain - the file was changed elsewhere */
+			journal_rec(j, j->pos, &after);
+			if(after.oldhash != rec.newhash)
+				break;
+		}
+
+		if(journal_apply(b, &rec, j->map + j->recs[j->pos - 1] + sizeof rec))
+			break;
+
+		*y = rec.start;
+		j->pos--;
+	}
+
+	if(i)
+		buffer_modified(b) = 1;
+	j->gen = b->gen;
+
+	return i;
+}
@@ -0,0 +1,25 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * journal - each write of a file records the lines it replaced, in
+ * ~/.uvijournal, so the versions saved before can be gone back to,
+ * even once the buffer has been closed
+ */
+
+struct journal;
+struct journal_write;
+
+/* around buffer_write() - before looks at the file as it is, after records the change */
+struct journal_write *journal_before(buffer_t *);
+void journal_after(buffer_t *, struct journal_write *, int written);
+
+/*
+ * go back n saved versions, setting *y to the first line changed
+ * returns how many it went back, or -1 if the buffer isn't as last saved
+ */
+int journal_earlier(buffer_t *, int n, int *y);
+
+void journal_free(struct journal *);
+
+#endif
@@ -25,13 +25,14 @@
 #include "buffers.h"
 #include "vars.h"
 #include "info.h"
+#include "recover.h"
 
 static void usage(const char *);
 
 
 void usage(const char *s)
 {
-	fprintf(stderr, "Usage: %s [-R] [--] [filename]\n", s);
+	fprintf(stderr, "Usage: %s [-R] [-L] [-r] [--] [filename]\n", s);
 	exit(1);
 }
 
@@ -39,7 +40,7 @@ void die(const char *fmt, ...)
 {
 	va_list l;
 	gui_term();
-	preserve(buffers_current());
+	preserve();
 
 	fprintf(stderr, "uvi: dying: ");
 	va_start(l, fmt);
@@ -53,7 +54,7 @@ void die(const char *fmt, ...)
 void sigh(const int sig)
 {
 	gui_term();
-	preserve(buffers_current());
+	preserve();
 	fprintf(stderr, "We get signal %d\n", sig);
 	exit(sig + 128);
 }
@@ -63,7 +64,7 @@ int main(int argc, const char **argv)
 	struct list *cmds = list_new(NULL);
 	int i, argv_options = 1;
 	int argv_fname_start = argc;
-	int ro = 0;
+	int ro = 0, lazy = 0, recover = 0;
 	int wait = 0;
 
 	if(setlocale(LC_ALL, "") == NULL){
@@ -97,6 +98,14 @@ int main(int argc, const char **argv)
 						ro = 1;
 						break;
 
+					case 'L':
+						lazy = 1;
+						break;
+
+					case 'r':
+						recover = 1;
+						break;
+
 					default:
 						fprintf(stderr, "unknown option: \"%s\"\n", argv[i]);
 						usage(*argv);
@@ -123,6 +132,12 @@ at_fnames:
 			break;
 		}
 
+	if(recover && argv_fname_start == argc){
+		recover_list();
+		list_free(cmds, free);
+		return 0;
+	}
+
 	if(list_count(cmds) > 0){
 		struct list *l = list_gettail(cmds);
 		while(l){
@@ -154,12 +169,13 @@ at_fnames:
 	buffers_init(
 			argc - argv_fname_start,
 			argv + argv_fname_start,
-			ro);
+			ro, lazy, recover);
 
 	gui_reload();
 	gui_run();
 
 	gui_term();
+	buffers_term();
 	info_write();
 	map_term();
 
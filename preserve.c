@@ -7,10 +7,12 @@
 
 #include "range.h"
 #include "buffer.h"
+#include "buffers.h"
 #include "preserve.h"
 #include "util/alloc.h"
+#include "recover.h"
 
-void preserve(buffer_t *b)
+static void preserve_buffer(buffer_t *b)
 {
 	char *fname;
 	FILE *f;
@@ -20,6 +22,12 @@ void preserve(buffer_t *b)
 	if(!b)
 		return;
 
+	/* the log has the changes already, bar what's yet to be written */
+	if(!recover_flush(b)){
+		fprintf(stderr, "changes kept - recover with uvi -r %s\n", buffer_filename(b));
+		return;
+	}
+
 	if(buffer_hasfilename(b))
 		fname = ustrprintf("%s_dump_a", buffer_filename(b));
 	else
@@ -38,3 +46,15 @@ void preserve(buffer_t *b)
 		fprintf(stderr, "couldn't preserve buffer - %s\n", strerror(errno));
 	}
 }
+
+void preserve(void)
+{
+	struct old_buffer **ob;
+
+	preserve_buffer(buffers_current());
+
+	/* and those kept, with changes, while others were edited */
+	for(ob = buffers_array(); ob && *ob; ob++)
+		if((*ob)->buf && buffer_modified((*ob)->buf))
+			preserve_buffer((*ob)->buf);
+}
@@ -1,6 +1,6 @@
 #ifndef PRESERVE_H
 #define PRESERVE_H
 
-void preserve(buffer_t *);
+void preserve(void); /* the current buffer, and any others with changes */
 
 #endif
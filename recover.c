@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/alloc.h"
+#include "range.h"
+#include "util/list.h"
+#include "buffer.h"
+#include "global.h"
+#include "files.h"
+#include "util/str.h"
+#include "recover.h"
+
+/*
+ * a log starts with the file's full path and its size and mtime when
+ * read, then a record per change: the lines it replaced, and the new
+ * lines, each '\n' terminated - or for a change within a line, the bytes
+ * it took out at x, and the nnew bytes put in their place, as they are.
+ * a torn record at the end is ignored
+ */
+#define RECOVER_MAGIC "uvw\002"
+#define RECORD_MAGIC  "uvwr"
+#define CHARS_MAGIC   "uvwc"
+
+/* records to gather before writing them, if there's no pause first */
+#define RECOVER_BATCH 64
+
+struct recover_head
+{
+	char magic[4];
+	unsigned int pathlen;
+	unsigned long long size;
+	long long mtime;
+	/* char path[pathlen]; */
+};
+
+struct record
+{
+	char magic[4];
+	int y, x, nold, nnew;
+	unsigned int len;
+};
+
+struct recover
+{
+	int fd; /* -1 if the log couldn't be made */
+	char *log;
+
+	/* records not yet written - those before ndone are whole */
+	char *pend;
+	size_t npend, ndone, siz;
+	int nrecs;
+
+	struct record rec; /* the one being added */
+	size_t at;
+
+	/* line edit_y as it was, while it's edited */
+	char *edit;
+	int edit_y, edit_len;
+};
+
+/* the file's full path, even if it's yet to be written */
+static char *recover_path(const char *fname)
+{
+	char *path, cwd[PATH_MAX];
+
+	if((path = realpath(fname, NULL)))
+		return path;
+	if(*fname == '/' || !getcwd(cwd, sizeof cwd))
+		return ustrdup(fname);
+	return ustrprintf("%s/%s", cwd, fname);
+}
+
+static const char *recover_log(const char *path)
+{
+	return file_recover(str_hash(STR_HASH_INIT, path, strlen(path)));
+}
+
+static struct recover *recover_new(buffer_t *b)
+{
+	struct recover_head head;
+	struct recover *r;
+	struct stat st;
+	char *path, *dir;
+
+	r = umalloc(sizeof *r);
+	memset(r, '\0', sizeof *r);
+
+	path = recover_path(buffer_filename(b));
+	r->log = ustrdup(recover_log(path));
+
+	dir = ustrdup(r->log);
+	*strrchr(dir, '/') = '\0';
+	mkdir(dir, 0700); /* may well exist */
+	free(dir);
+
+	memset(&head, '\0', sizeof head);
+	memcpy(head.magic, RECOVER_MAGIC, sizeof head.magic);
+	head.pathlen = strlen(path);
+	if(stat(buffer_filename(b), &st) == 0){
+		head.size  = st.st_size;
+		head.mtime = st.st_mtime;
+	}else{
+		head.mtime = -1;
+	}
+
+	if((r->fd = open(r->log, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1
+	&& (write(r->fd, &head, sizeof head) != sizeof head
+	 || write(r->fd, path, head.pathlen) != (ssize_t)head.pathlen)){
+		close(r->fd);
+		remove(r->log);
+		r->fd = -1;
+	}
+
+	free(path);
+	return r;
+}
+
+static struct recover *recover_get(buffer_t *b)
+{
+	if(!b->recover){
+		if(!global_settings.recover || !buffer_hasfilename(b))
+			return NULL;
+		b->recover = recover_new(b);
+	}
+	return b->recover->fd == -1 ? NULL : b->recover;
+}
+
+static void recover_add(struct recover *r, const void *p, size_t n)
+{
+	if(r->npend + n > r->siz){
+		r->siz = r->npend + n > 2 * r->siz ? r->npend + n : 2 * r->siz;
+		r->pend = urealloc(r->pend, r->siz);
+	}
+	memcpy(r->pend + r->npend, p, n);
+	r->npend += n;
+}
+
+void recover_lines_begin(buffer_t *b, int y, int nold)
+{
+	struct recover *r = recover_get(b);
+
+	if(!r)
+		return;
+
+	memset(&r->rec, '\0', sizeof r->rec);
+	memcpy(r->rec.magic, RECORD_MAGIC, sizeof r->rec.magic);
+	r->rec.y = y;
+	r->rec.nold = nold;
+
+	/* filled in at the end */
+	r->at = r->npend;
+	recover_add(r, &r->rec, sizeof r->rec);
+}
+
+void recover_line(buffer_t *b, const char *s, int len)
+{
+	struct recover *r = recover_get(b);
+
+	if(r){
+		recover_add(r, s, len);
+		recover_add(r, "\n", 1);
+		r->rec.nnew++;
+		r->rec.len += len + 1;
+	}
+}
+
+/* the record just added is whole */
+static void recover_done(buffer_t *b, struct recover *r)
+{
+	r->ndone = r->npend;
+
+	if(++r->nrecs >= RECOVER_BATCH)
+		recover_flush(b);
+}
+
+void recover_lines_end(buffer_t *b)
+{
+	struct recover *r = recover_get(b);
+
+	if(!r)
+		return;
+
+	memcpy(r->pend + r->at, &r->rec, sizeof r->rec);
+	recover_done(b, r);
+}
+
+void recover_chars(buffer_t *b, int y, int x, int nold, const char *s, int n)
+{
+	struct recover *r = recover_get(b);
+	struct record rec;
+
+	if(!r || (!nold && !n))
+		return;
+
+	memset(&rec, '\0', sizeof rec);
+	memcpy(rec.magic, CHARS_MAGIC, sizeof rec.magic);
+	rec.y = y;
+	rec.x = x;
+	rec.nold = nold;
+	rec.nnew = n;
+	rec.len = n;
+
+	recover_add(r, &rec, sizeof rec);
+	recover_add(r, s, n);
+	recover_done(b, r);
+}
+
+void recover_line_edit(buffer_t *b, int y, const char *s, int len)
+{
+	struct recover *r = recover_get(b);
+
+	if(!r || (r->edit && r->edit_y == y))
+		return;
+
+	free(r->edit);
+	r->edit = umalloc(len + 1);
+	memcpy(r->edit, s, len + 1);
+	r->edit_y = y;
+	r->edit_len = len;
+}
+
+void recover_line_changed(buffer_t *b, int y, const char *s, int len)
+{
+	struct recover *r = recover_get(b);
+	int pre = 0, suf = 0;
+
+	if(!r || !r->edit)
+		return;
+
+	if(r->edit_y == y){
+		/* only what's between what's the same at either end */
+		while(pre < len && pre < r->edit_len && s[pre] == r->edit[pre])
+			pre++;
+		while(suf < len - pre && suf < r->edit_len - pre
+		&& s[len - suf - 1] == r->edit[r->edit_len - suf - 1])
+			suf++;
+
+		recover_chars(b, y, pre, r->edit_len - pre - suf, s + pre, len - pre - suf);
+	}
+
+	free(r->edit);
+	r->edit = NULL;
+}
+
+int recover_pending(buffer_t *b)
+{
+	return b && b->recover && b->recover->ndone;
+}
+
+/* only write() and memmove(), since this may be from a signal handler */
+int recover_flush(buffer_t *b)
+{
+	struct recover *r = b ? b->recover : NULL;
+	size_t off = 0;
+
+	if(!r || r->fd == -1)
+		return 1;
+
+	while(off < r->ndone){
+		const ssize_t n = write(r->fd, r->pend + off, r->ndone - off);
+
+		if(n <= 0){
+			if(n == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+
+	if(global_settings.fsync)
+		fsync(r->fd);
+
+	memmove(r->pend, r->pend + off, r->npend - off);
+	r->npend -= off;
+	r->ndone -= off;
+	r->at -= off;
+	if(!r->ndone)
+		r->nrecs = 0;
+
+	return 0;
+}
+
+static void recover_close(struct recover *r)
+{
+	if(r->fd != -1){
+		close(r->fd);
+		remove(r->log);
+	}
+	free(r->log);
+	free(r->pend);
+	free(r->edit);
+	free(r);
+}
+
+void recover_written(buffer_t *b)
+{
+	/* a new log is started by the next change */
+	if(b->recover){
+		recover_close(b->recover);
+		b->recover = NULL;
+	}
+}
+
+void recover_free(struct recover *r)
+{
+	if(r)
+		recover_close(r);
+}
+
+/* the whole log, checked, or NULL */
+static char *recover_read(const char *log, size_t *plen, struct recover_head *head, const char *path)
+{
+	struct stat st;
+	char *mem;
+	int fd;
+
+	if((fd = open(log, O_RDONLY)) == -1)
+		return NULL;
+
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof *head){
+		close(fd);
+		return NULL;
+	}
+
+	mem = umalloc(st.st_size);
+	if(read(fd, mem, st.st_size) != st.st_size){
+		close(fd);
+		free(mem);
+		return NULL;
+	}
+	close(fd);
+
+	memcpy(head, mem, sizeof *head);
+	if(memcmp(head->magic, RECOVER_MAGIC, sizeof head->magic)
+	|| head->pathlen > st.st_size - sizeof *head
+	|| (path && (head->pathlen != strlen(path) || memcmp(mem + sizeof *head, path, head->pathlen)))){
+		free(mem);
+		return NULL;
+	}
+
+	*plen = st.st_size;
+	return mem;
+}
+
+/* lines [rec->y, + nold) become the nnew lines in text */
+static int recover_apply(buffer_t *b, const struct record *rec, const char *text)
+{
+	const char *const end = text + rec->len;
+	int i;
+
+	if(rec->y < 0 || rec->nold < 0 || rec->y + rec->nold > buffer_nlines(b))
+		return 1;
+
+	if(rec->nnew){
+		struct list *l, *tail;
+
+		/* shared, so the lines keep their lengths - they may have '\0's */
+		tail = l = list_new(NULL);
+		for(i = 0; i < rec->nnew; i++){
+			const char *nl = memchr(text, '\n', end - text);
+
+			list_append(tail, str_share(text, nl - text));
+			tail = list_gettail(tail);
+
+			text = nl + 1;
+		}
+
+		/* in first, so the buffer is never left empty */
+		if(rec->y < buffer_nlines(b))
+			buffer_sharelistbefore(b, buffer_getindex(b, rec->y), l);
+		else
+			buffer_sharelistafter(b, buffer_gettail(b), l);
+		list_free(l, str_unref);
+	}
+
+	if(rec->nold){
+		struct range r;
+
+		r.start = rec->y + rec->nnew;
+		r.end   = r.start + rec->nold - 1;
+		buffer_remove_range(b, &r);
+	}
+
+	return 0;
+}
+
+/* nold bytes at rec->x in line rec->y become the nnew in text */
+static int recover_apply_chars(buffer_t *b, const struct record *rec, const char *text)
+{
+	struct list *l;
+
+	if(rec->y < 0 || rec->y >= buffer_nlines(b))
+		return 1;
+
+	l = buffer_getindex(b, rec->y);
+	if(rec->x < 0 || rec->nold < 0 || rec->nold > buffer_line_len(l) - rec->x)
+		return 1;
+
+	if(rec->nold)
+		buffer_line_delete(b, l, rec->x, rec->nold);
+	if(rec->nnew)
+		buffer_line_insert(b, l, rec->x, text, rec->nnew);
+
+	return 0;
+}
+
+int recover_replay(buffer_t *b, int *stale)
+{
+	struct recover_head head;
+	struct stat st;
+	char *path, *mem;
+	size_t len, off;
+	int n = 0;
+
+	if(!buffer_hasfilename(b))
+		return -1;
+
+	path = recover_path(buffer_filename(b));
+	mem = recover_read(recover_log(path), &len, &head, path);
+	if(!mem){
+		free(path);
+		return -1;
+	}
+
+	/* the replayed changes go into a new log */
+	remove(recover_log(path));
+	free(path);
+
+	if(stat(buffer_filename(b), &st))
+		*stale = head.mtime != -1;
+	else
+		*stale = head.size != (unsigned long long)st.st_size || head.mtime != (long long)st.st_mtime;
+
+	buffer_loadall(b);
+
+	for(off = sizeof head + head.pathlen; len - off >= sizeof(struct record); ){
+		struct record rec;
+		const char *text, *p;
+		int i;
+
+		memcpy(&rec, mem + off, sizeof rec);
+		text = mem + off + sizeof rec;
+		if(rec.len > len - off - sizeof rec)
+			break;
+
+		if(!memcmp(rec.magic, CHARS_MAGIC, sizeof rec.magic)){
+			if(rec.nnew < 0 || (unsigned int)rec.nnew != rec.len
+			|| recover_apply_chars(b, &rec, text))
+				break;
+		}else{
+			if(memcmp(rec.magic, RECORD_MAGIC, sizeof rec.magic))
+				break;
+
+			/* the lines must all be there */
+			for(i = 0, p = text; p < text + rec.len; p++)
+				if(*p == '\n')
+					i++;
+			if(i != rec.nnew || (rec.len && text[rec.len - 1] != '\n'))
+				break;
+
+			if(recover_apply(b, &rec, text))
+				break;
+		}
+
+		n++;
+		off += sizeof rec + rec.len;
+	}
+
+	free(mem);
+
+	if(n)
+		buffer_modified(b) = 1;
+	recover_flush(b);
+
+	return n;
+}
+
+void recover_list(void)
+{
+	char *dir = ustrdup(file_recover(0));
+	struct dirent *ent;
+	DIR *d;
+
+	*strrchr(dir, '/') = '\0';
+
+	if((d = opendir(dir))){
+		while((ent = readdir(d))){
+			struct recover_head head;
+			struct stat st;
+			char *log, *mem;
+			size_t len;
+
+			if(*ent->d_name == '.')
+				continue;
+
+			log = ustrprintf("%s/%s", dir, ent->d_name);
+			if((mem = recover_read(log, &len, &head, NULL)) && stat(log, &st) == 0){
+				char when[32];
+
+				strftime(when, sizeof when, "%Y-%m-%d %H:%M", localtime(&st.st_mtime));
+				printf("%s  %.*s\n", when, (int)head.pathlen, mem + sizeof head);
+			}
+			free(mem);
+			free(log);
+		}
+		closedir(d);
+	}
+
+	free(dir);
+}
@@ -0,0 +1,34 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+
+/*
+ * recovery - changes to a named buffer are logged to ~/.uvirecover as
+ * they're made, so "uvi -r" can rebuild the buffer from the file and
+ * the log after a crash. the log is written in batches, and removed
+ * once the buffer's written or closed
+ */
+
+struct recover;
+
+/* from buffer.c - lines [y, y + nold) are replaced by those given */
+void recover_lines_begin(buffer_t *, int y, int nold);
+void recover_line(       buffer_t *, const char *, int len);
+void recover_lines_end(  buffer_t *);
+
+/* or, in line y, nold bytes at x are replaced by s[0, n) */
+void recover_chars(buffer_t *, int y, int x, int nold, const char *s, int n);
+
+/* around an edit of line y in place, to log only what it changed */
+void recover_line_edit(   buffer_t *, int y, const char *, int len);
+void recover_line_changed(buffer_t *, int y, const char *, int len);
+
+int  recover_pending(buffer_t *);
+int  recover_flush(  buffer_t *); /* safe from a signal handler - 0 if there is a log */
+void recover_written(buffer_t *); /* the log starts again from the file as written */
+void recover_free(struct recover *); /* removing the log */
+
+/* replay a log onto a freshly read buffer - returns the changes made, or -1 if there's none */
+int  recover_replay(buffer_t *, int *stale);
+void recover_list(void); /* what there is to recover, to stdout */
+
+#endif
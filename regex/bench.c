@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <regex.h>
+
+#include "regex.h"
+
+/*
+ * regex_matches() against regexec(), on each line of a file, or of some
+ * made up text if there isn't one, then on lines that make a backtracker
+ * take a long time
+ */
+
+#define LINES 200000
+
+static const char *const pats[] = {
+	"timeout", "some.*timeout [0-9]+", "[a-z]+_[0-9]+x", "(foo|bar|baz)qux", "^ +[A-Z]", "\\<x[a-z]*\\>", "q$",
+};
+
+static char **lines;
+static int nlines;
+
+static void readlines(const char *fname)
+{
+	FILE *f = fname ? fopen(fname, "r") : NULL;
+	char buf[4096];
+	int i;
+
+	lines = malloc(LINES * sizeof *lines);
+	if(!lines)
+		abort();
+
+	for(i = 0; i < LINES; i++){
+		if(f){
+			if(!fgets(buf, sizeof buf, f))
+				break;
+		}else{
+			sprintf(buf, "    some_%d words, then a timeout %d and xyz%d\n", i, i * 7, i % 13);
+		}
+		if(!(lines[i] = malloc(strlen(buf) + 1)))
+			abort();
+		strcpy(lines[i], buf);
+	}
+	nlines = i;
+
+	if(f)
+		fclose(f);
+}
+
+static double now(void)
+{
+	return clock() / (double)CLOCKS_PER_SEC;
+}
+
+static void bench(const char *pat)
+{
+	struct regex *r = regex_create(pat, 0);
+	regex_t re;
+	regmatch_t m;
+	double t;
+	int i, start, end, nr = 0, nre = 0;
+
+	if(!r){
+		printf("%-24s not handled\n", pat);
+		return;
+	}
+	if(regcomp(&re, pat, REG_EXTENDED)){
+		regex_free(r);
+		return;
+	}
+
+	t = now();
+	for(i = 0; i < nlines; i++)
+		nr += regex_matches(r, lines[i], 0, strlen(lines[i]), &start, &end) == 1;
+	printf("%-24s regex_matches() %6.3fs", pat, now() - t);
+
+	t = now();
+	for(i = 0; i < nlines; i++){
+		m.rm_so = 0;
+		m.rm_eo = strlen(lines[i]);
+		nre += !regexec(&re, lines[i], 1, &m, REG_STARTEND);
+	}
+	printf("  regexec() %6.3fs  %d matches%s\n", now() - t, nr, nr == nre ? "" : " (differ)");
+
+	regex_free(r);
+	regfree(&re);
+}
+
+/* exponential for backtracking - regexec() may not finish these, so they're alone */
+static void bench_slow(void)
+{
+	static const char *const slow[] = { "(a|aa)*c", "(a*)*b", "(x+x+)+y" };
+	static char s[100001];
+	unsigned int i;
+
+	memset(s, 'a', sizeof s - 1);
+
+	for(i = 0; i < sizeof slow / sizeof *slow; i++){
+		struct regex *r = regex_create(slow[i], 0);
+		double t = now();
+		int start, end;
+
+		if(r)
+			regex_matches(r, s, 0, sizeof s - 1, &start, &end);
+		printf("%-24s regex_matches() %6.3fs on 100000 a's\n", slow[i], now() - t);
+		regex_free(r);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	readlines(argc > 1 ? argv[1] : NULL);
+	printf("%d lines\n", nlines);
+
+	for(i = 0; i < sizeof pats / sizeof *pats; i++)
+		bench(pats[i]);
+	bench_slow();
+
+	return 0;
+}
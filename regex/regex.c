@@ -1,134 +1,1316 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <ctype.h>
 
 #include "regex.h"
 
+#define REGEX_MAXPROG   20000 /* instructions, once counted repeats are written out */
+#define REGEX_MAXDEPTH  256   /* nested groups */
+#define REGEX_DUPMAX    0x7fff /* as glibc's RE_DUP_MAX */
+#define REGEX_MAXSTATES 128   /* dfa states kept, before starting again */
+#define REGEX_HASH      256
+
+/* instructions - classes consume a byte, the rest are free */
+enum { I_CLASS, I_SPLIT, I_JMP, I_ASSERT, I_MATCH };
+
+enum { A_BOL, A_EOL, A_WORD, A_NOTWORD, A_WORDSTART, A_WORDEND };
+
+/* what assertions look at, about a position */
+#define C_BOL   1
+#define C_EOL   2
+#define C_PREVW 4
+#define C_NEXTW 8
+
+#define C_ANCHORED 16 /* of a dfa state - no new matches start after it */
+
+/* in UTF-8, matches start at characters - before c, unless it's in the middle of one */
+#define STARTS_BEFORE(r, c) (!(r)->utf8 || ((c) & 0xc0) != 0x80)
+
+struct inst
+{
+	unsigned char op, arg; /* arg: the assertion */
+	int x, y; /* class: x is which, jmp: x, split: both */
+};
+
+typedef unsigned char charset[256 / 8];
+
+#define SET_HAS(set, c) ((set)[(unsigned char)(c) >> 3] &   (1 << ((unsigned char)(c) & 7)))
+#define SET_ADD(set, c) ((set)[(unsigned char)(c) >> 3] |=  (1 << ((unsigned char)(c) & 7)))
+
 /*
- * char *str;
- * enum { NONE, STAR, PLUS } noderepeat;
- * struct _regex *next;
+ * a dfa state is the set of instructions the NFA could be at - classes,
+ * assertions and matches, with splits and jumps followed - and what the
+ * assertions need to know of what came before. the instructions are in
+ * groups, by where their match would start, earliest first, with -1
+ * between. next[] and acc are filled in as bytes are met
  */
+struct dstate
+{
+	struct dstate *next[256];
+	struct dstate *hnext, *all;
+	charset acc; /* a match ends before the byte */
+	int acceot; /* or at the end - -1 if not yet known */
+	int ctx; /* C_BOL, C_PREVW, C_ANCHORED */
+	int npcs;
+	int pcs[1]; /* npcs of them, each group sorted */
+};
 
-regex_t *regex_create(const char *s)
+struct regex
 {
-	regex_t *r = malloc(sizeof(*r));
-	const char *start = s;
-	int len;
+	struct inst *prog;
+	int nprog;
+	charset *cls;
+	int ncls;
+	int ctxmask; /* which of C_BOL and C_PREVW the assertions look at */
+	int utf8;
+	charset first; /* the bytes a match can start with */
+	int empty; /* or if it can be empty, any */
+	int bol; /* matches can only start at the beginning */
 
-	printf("regex_create(\"%s\")\n", s);
-	fflush(stdout);
+	/* the same, matched from right to left - where matches start */
+	struct regex *rev;
 
+	/* the dfa */
+	struct dstate *htab[REGEX_HASH];
+	struct dstate *states, *start[(C_ANCHORED | C_BOL | C_PREVW) + 1];
+	struct dstate *dead; /* nothing going, and nothing more to start */
+	int nstates;
+	unsigned long flushes;
 
-	if(!r)
-		return NULL;
+	/* scratch, nprog long - sets twice that, for the -1s between groups */
+	unsigned int *mark, gen;
+	int *stack, *set, *set2;
+};
 
-	errno = 0;
+/* parse tree - built, then written out as instructions */
+enum { N_EMPTY, N_CLASS, N_ASSERT, N_CAT, N_ALT, N_REPEAT };
 
-	while(*s && *s != '*' && *s != '+' && *s != '?')
-		s++;
+struct node
+{
+	int type;
+	int l, r; /* cat and alt - repeat has l */
+	int arg; /* the class, or the assertion */
+	int min, max; /* max is -1 for no limit */
+};
 
-	len = s - start;
+struct parse
+{
+	const char *s;
+	int icase, utf8;
+	int depth;
 
-	if(len){
-		r->str = malloc(len + 1);
-		if(!r->str)
-			goto membail;
+	struct node *nodes;
+	int nnodes, anodes;
+	charset *cls;
+	int ncls, acls;
+	int mbcls[8][4]; /* classes for the bytes of UTF-8 sequences, once made */
+	int mbmade;
 
-		strncpy(r->str, start, len);
+	struct inst *prog;
+	int nprog, aprog;
+	long work;
+	int reverse; /* writing out the instructions to match backwards */
+};
 
-		if(*s == '\0'){
-			r->next = malloc(sizeof(*r));
-			if(!r->next)
-				goto membail;
-		}
-	}else if(*s == '\0'){
-		free(r);
-		return NULL;
-	}else
-		r->str = NULL;
+static int parse_alt(struct parse *);
+static void firstbytes(struct regex *);
 
-	switch(*s){
-		case '*':
-			r->noderepeat = STAR;
+static int isword(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+/* 1 for UTF-8, 0 for single byte characters, -1 for other encodings */
+static int locale_utf8(void)
+{
+	wchar_t wc;
+
+	if(MB_CUR_MAX == 1)
+		return 0;
+
+	mbtowc(NULL, NULL, 0);
+	return mbtowc(&wc, "\xc3\xa9", 2) == 2 && wc == 0xe9 ? 1 : -1;
+}
+
+/* the valid UTF-8 sequences - the range each byte can be in */
+static const unsigned char utf8_seqs[8][4][2] = {
+	{ { 0xc2, 0xdf }, { 0x80, 0xbf } },
+	{ { 0xe0, 0xe0 }, { 0xa0, 0xbf }, { 0x80, 0xbf } },
+	{ { 0xe1, 0xec }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+	{ { 0xed, 0xed }, { 0x80, 0x9f }, { 0x80, 0xbf } },
+	{ { 0xee, 0xef }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+	{ { 0xf0, 0xf0 }, { 0x90, 0xbf }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+	{ { 0xf1, 0xf3 }, { 0x80, 0xbf }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+	{ { 0xf4, 0xf4 }, { 0x80, 0x8f }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+};
+
+/* the length of the multibyte character at s (up to n bytes), or 0 if it isn't one */
+static int utf8_len(const char *s, int n)
+{
+	const int c = (unsigned char)*s;
+	int i, j;
+
+	for(i = 0; i < 8; i++)
+		if(utf8_seqs[i][0][0] <= c && c <= utf8_seqs[i][0][1])
 			break;
+	if(i == 8)
+		return 0;
 
-		case '+':
-			r->noderepeat = PLUS;
+	for(j = 1; j < 4 && utf8_seqs[i][j][0]; j++)
+		if(j >= n || (unsigned char)s[j] < utf8_seqs[i][j][0] || (unsigned char)s[j] > utf8_seqs[i][j][1])
+			return 0;
+	return j;
+}
+
+/* whether a character starts at pos - it isn't in the middle of one */
+static int utf8_boundary(const char *s, int pos, int len)
+{
+	int i;
+
+	for(i = 1; i <= 3 && i <= pos; i++){
+		const int n = utf8_len(s + pos - i, len - pos + i);
+
+		if(n)
+			return n <= i;
+		if(((unsigned char)s[pos - i] & 0xc0) != 0x80)
 			break;
+	}
+	return 1;
+}
 
-		case '?':
-			r->noderepeat = QMARK;
+static int newnode(struct parse *p, int type)
+{
+	struct node *n;
+
+	if(p->nnodes == p->anodes){
+		const int a = p->anodes ? 2 * p->anodes : 32;
+		struct node *nodes = realloc(p->nodes, a * sizeof *nodes);
+
+		if(!nodes){
+			errno = ENOMEM;
+			return -1;
+		}
+		p->nodes = nodes;
+		p->anodes = a;
+	}
+
+	n = &p->nodes[p->nnodes];
+	memset(n, '\0', sizeof *n);
+	n->type = type;
+	return p->nnodes++;
+}
+
+static int newclass(struct parse *p)
+{
+	if(p->ncls == p->acls){
+		const int a = p->acls ? 2 * p->acls : 16;
+		charset *cls = realloc(p->cls, a * sizeof *cls);
+
+		if(!cls){
+			errno = ENOMEM;
+			return -1;
+		}
+		p->cls = cls;
+		p->acls = a;
+	}
+
+	memset(p->cls[p->ncls], '\0', sizeof *p->cls);
+	return p->ncls++;
+}
+
+static int classnode(struct parse *p, int cls)
+{
+	int n;
+
+	if(cls == -1 || (n = newnode(p, N_CLASS)) == -1)
+		return -1;
+	p->nodes[n].arg = cls;
+	return n;
+}
+
+static int binnode(struct parse *p, int type, int l, int r)
+{
+	int n;
+
+	if(l == -1 || r == -1 || (n = newnode(p, type)) == -1)
+		return -1;
+	p->nodes[n].l = l;
+	p->nodes[n].r = r;
+	return n;
+}
+
+static int rangeclass(struct parse *p, int lo, int hi)
+{
+	int cls = newclass(p);
+
+	if(cls != -1)
+		for(; lo <= hi; lo++)
+			SET_ADD(p->cls[cls], lo);
+	return cls;
+}
+
+/* what REG_ICASE matches - anything that's the same, lowercased */
+static void fold(charset set)
+{
+	charset lower;
+	int c;
+
+	memset(lower, '\0', sizeof lower);
+	for(c = 0; c < 256; c++)
+		if(SET_HAS(set, c))
+			SET_ADD(lower, tolower(c));
+
+	for(c = 0; c < 256; c++)
+		if(SET_HAS(lower, tolower(c)))
+			SET_ADD(set, c);
+}
+
+/*
+ * in UTF-8, set's ASCII, or any other whole character - '.' and [^...]
+ * match characters, not bytes, and not invalid bytes at all
+ */
+static int mbnode(struct parse *p, int cls)
+{
+	int n = classnode(p, cls), i, j;
+
+	for(i = 0; i < 8; i++){
+		int seq = -1;
+
+		for(j = 3; j >= 0; j--){
+			if(!utf8_seqs[i][j][0])
+				continue;
+			if(!p->mbmade)
+				p->mbcls[i][j] = rangeclass(p, utf8_seqs[i][j][0], utf8_seqs[i][j][1]);
+			seq = seq == -1 ? classnode(p, p->mbcls[i][j])
+				: binnode(p, N_CAT, classnode(p, p->mbcls[i][j]), seq);
+		}
+
+		n = binnode(p, N_ALT, n, seq);
+	}
+
+	p->mbmade = 1;
+	return n;
+}
+
+/* a class matching anything except what's in set (and '\0') */
+static int negated(struct parse *p, int cls)
+{
+	int c;
+
+	for(c = 0; c < 256; c++)
+		p->cls[cls][c >> 3] ^= 1 << (c & 7);
+	p->cls[cls][0] &= ~1;
+
+	if(!p->utf8)
+		return classnode(p, cls);
+
+	/* the bytes of other characters are in mbnode() */
+	for(c = 0x80; c < 256; c++)
+		p->cls[cls][c >> 3] &= ~(1 << (c & 7));
+	return mbnode(p, cls);
+}
+
+static int charclass(const char *name, size_t len, int utf8, charset set)
+{
+	static const struct
+	{
+		const char *name;
+		int (*f)(int);
+		int utf8; /* the same in UTF-8, where non-ASCII characters could be in it */
+	} classes[] = {
+		{ "alpha",  isalpha,  0 },
+		{ "digit",  isdigit,  1 },
+		{ "alnum",  isalnum,  0 },
+		{ "upper",  isupper,  0 },
+		{ "lower",  islower,  0 },
+		{ "space",  isspace,  0 },
+		{ "punct",  ispunct,  0 },
+		{ "print",  isprint,  0 },
+		{ "graph",  isgraph,  0 },
+		{ "cntrl",  iscntrl,  0 },
+		{ "xdigit", isxdigit, 1 },
+	};
+	unsigned int i;
+	int c;
+
+	for(i = 0; i < sizeof classes / sizeof *classes; i++)
+		if(strlen(classes[i].name) == len && !strncmp(classes[i].name, name, len))
 			break;
 
-		case '\0':
-			r->noderepeat = NONE;
+	/* "blank" is C99 */
+	if(i == sizeof classes / sizeof *classes){
+		if(len != 5 || strncmp(name, "blank", 5) || utf8)
+			return -1;
+		SET_ADD(set, ' ');
+		SET_ADD(set, '\t');
+		return 0;
+	}
+
+	if(utf8 && !classes[i].utf8)
+		return -1;
+
+	for(c = 1; c < 256; c++)
+		if(classes[i].f(c))
+			SET_ADD(set, c);
+	return 0;
+}
+
+/* one end of a range, or a character on its own - -1 on error */
+static int bracket_char(struct parse *p)
+{
+	int c;
+
+	if(p->s[0] == '[' && (p->s[1] == '.' || p->s[1] == '=')){
+		/* single characters only - they're their own collating elements */
+		if(!p->s[2] || p->s[3] != p->s[1] || p->s[4] != ']' || p->utf8)
+			return -1;
+		c = (unsigned char)p->s[2];
+		p->s += 5;
+		return c;
+	}
+
+	c = (unsigned char)*p->s++;
+	if(p->utf8 && c >= 0x80)
+		return -1;
+	return c;
+}
+
+static int parse_bracket(struct parse *p)
+{
+	int cls, neg = 0, first = 1;
+
+	if((cls = newclass(p)) == -1)
+		return -1;
+
+	if(*++p->s == '^'){
+		neg = 1;
+		p->s++;
+	}
+
+	for(;;){
+		int lo, hi;
+
+		if(!*p->s)
+			goto inval;
+		if(*p->s == ']' && !first){
+			p->s++;
 			break;
+		}
+		first = 0;
+
+		if(p->s[0] == '[' && p->s[1] == ':'){
+			const char *end = strstr(p->s + 2, ":]");
+
+			if(!end || charclass(p->s + 2, end - p->s - 2, p->utf8, p->cls[cls]))
+				goto inval;
+			p->s = end + 2;
+			continue;
+		}
+
+		if((lo = bracket_char(p)) == -1)
+			goto inval;
+		hi = lo;
+
+		if(p->s[0] == '-' && p->s[1] && p->s[1] != ']'){
+			p->s++;
+			if((hi = bracket_char(p)) == -1 || hi < lo)
+				goto inval;
+		}
 
-		default:
-			fprintf(stderr, "MAJOR REGEX ERROR: '%c'\n", *s);
-			return NULL;
+		for(; lo <= hi; lo++)
+			SET_ADD(p->cls[cls], lo);
 	}
 
-	if(r->noderepeat != NONE && !len){
+	if(p->icase)
+		fold(p->cls[cls]);
+
+	return neg ? negated(p, cls) : classnode(p, cls);
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static int assertnode(struct parse *p, int a)
+{
+	int n;
+
+	if((n = newnode(p, N_ASSERT)) == -1)
+		return -1;
+	p->nodes[n].arg = a;
+	return n;
+}
+
+static int literal(struct parse *p, int c)
+{
+	int cls;
+
+	if(p->utf8 && p->icase && c >= 0x80){
+		/* case folding of whole characters */
 		errno = EINVAL;
-		return NULL;
+		return -1;
+	}
+
+	if((cls = newclass(p)) == -1)
+		return -1;
+	SET_ADD(p->cls[cls], c);
+	if(p->icase)
+		fold(p->cls[cls]);
+	return classnode(p, cls);
+}
+
+static int parse_escape(struct parse *p)
+{
+	const int c = (unsigned char)*++p->s;
+	int cls;
+
+	if(!c)
+		goto inval;
+	p->s++;
+
+	if(strchr("<>bB", c)){
+		if(p->utf8)
+			goto inval;
+		return assertnode(p,
+				c == '<' ? A_WORDSTART :
+				c == '>' ? A_WORDEND :
+				c == 'b' ? A_WORD : A_NOTWORD);
+	}
+
+	if(strchr("wWsS", c)){
+		int i;
+
+		if(p->utf8)
+			goto inval;
+		if((cls = newclass(p)) == -1)
+			return -1;
+		for(i = 1; i < 256; i++)
+			if(c == 'w' || c == 'W' ? isword(i) : isspace(i))
+				SET_ADD(p->cls[cls], i);
+		return islower(c) ? classnode(p, cls) : negated(p, cls);
 	}
 
-	if(*s == '\0')
-		r->next = NULL;
-	else
-		r->next = regex_create(s + 1);
+	/* \` \' and backreferences, or anything else with a meaning to come */
+	if(!ispunct(c) || c == '`' || c == '\'')
+		goto inval;
+
+	return literal(p, c);
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static int parse_atom(struct parse *p)
+{
+	int n, cls;
+
+	switch(*p->s){
+		case '(':
+			if(++p->depth > REGEX_MAXDEPTH)
+				goto inval;
+			p->s++;
+			if((n = parse_alt(p)) == -1)
+				return -1;
+			if(*p->s != ')')
+				goto inval;
+			p->s++;
+			p->depth--;
+			return n;
+
+		case '[':
+			return parse_bracket(p);
+
+		case '.':
+			p->s++;
+			if((cls = newclass(p)) == -1)
+				return -1;
+			return negated(p, cls);
+
+		case '^':
+			p->s++;
+			return assertnode(p, A_BOL);
+		case '$':
+			p->s++;
+			return assertnode(p, A_EOL);
+
+		case '\\':
+			return parse_escape(p);
+
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			/* nothing to repeat - what that means varies */
+			goto inval;
+	}
+
+	if(p->utf8 && (unsigned char)*p->s >= 0x80){
+		/* a whole character, so a repeat is of all of it */
+		const int len = utf8_len(p->s, strlen(p->s));
+		int i;
+
+		if(!len || p->icase)
+			goto inval;
+		for(n = literal(p, (unsigned char)*p->s), i = 1; i < len; i++)
+			n = binnode(p, N_CAT, n, literal(p, (unsigned char)p->s[i]));
+		p->s += len;
+		return n;
+	}
+
+	return literal(p, (unsigned char)*p->s++);
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static int parse_number(struct parse *p)
+{
+	int n = 0;
+
+	if(!isdigit((unsigned char)*p->s))
+		return -1;
+	for(; isdigit((unsigned char)*p->s); p->s++)
+		if((n = n * 10 + *p->s - '0') > REGEX_DUPMAX)
+			return -1;
+	return n;
+}
+
+static int parse_repeat(struct parse *p)
+{
+	int n = parse_atom(p);
+
+	while(n != -1 && *p->s && strchr("*+?{", *p->s)){
+		int min = 0, max = -1, rep;
+
+		if(p->nodes[n].type == N_ASSERT)
+			goto inval;
+
+		switch(*p->s++){
+			case '+':
+				min = 1;
+				break;
+			case '?':
+				max = 1;
+				break;
+			case '{':
+				if((min = parse_number(p)) == -1)
+					goto inval;
+				max = min;
+				if(*p->s == ','){
+					p->s++;
+					max = *p->s == '}' ? -1 : parse_number(p);
+					if(max != -1 && max < min)
+						goto inval;
+				}
+				if(*p->s++ != '}')
+					goto inval;
+				break;
+		}
+
+		if((rep = newnode(p, N_REPEAT)) == -1)
+			return -1;
+		p->nodes[rep].l = n;
+		p->nodes[rep].min = min;
+		p->nodes[rep].max = max;
+		n = rep;
+	}
+
+	return n;
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static int parse_cat(struct parse *p)
+{
+	int n = newnode(p, N_EMPTY);
+
+	while(n != -1 && *p->s && *p->s != '|' && *p->s != ')')
+		n = binnode(p, N_CAT, n, parse_repeat(p));
+
+	return n;
+}
+
+static int parse_alt(struct parse *p)
+{
+	int n = parse_cat(p);
+
+	while(n != -1 && *p->s == '|'){
+		p->s++;
+		n = binnode(p, N_ALT, n, parse_cat(p));
+	}
+
+	return n;
+}
+
+static int emit(struct parse *p, int op, int x, int y)
+{
+	if(p->nprog == p->aprog){
+		const int a = p->aprog ? 2 * p->aprog : 64;
+		struct inst *prog;
+
+		if(a > 2 * REGEX_MAXPROG){
+			errno = EINVAL;
+			return -1;
+		}
+		if(!(prog = realloc(p->prog, a * sizeof *prog))){
+			errno = ENOMEM;
+			return -1;
+		}
+		p->prog = prog;
+		p->aprog = a;
+	}
+
+	p->prog[p->nprog].op = op;
+	p->prog[p->nprog].arg = 0;
+	p->prog[p->nprog].x = x;
+	p->prog[p->nprog].y = y;
+	return p->nprog++;
+}
 
+/* the assertion that's the same, looking the other way */
+static int mirror(int a)
+{
+	switch(a){
+		case A_BOL:       return A_EOL;
+		case A_EOL:       return A_BOL;
+		case A_WORDSTART: return A_WORDEND;
+		case A_WORDEND:   return A_WORDSTART;
+	}
+	return a;
+}
+
+/*
+ * only the language matters, not which way it's matched, since there's
+ * one match wanted, the leftmost longest. so x{2,4} is just xxx?x?
+ *
+ * backwards, what's concatenated is written out last first, and what
+ * comes before a position is what comes after it
+ */
+static int compile(struct parse *p, int n)
+{
+	const struct node *node = &p->nodes[n];
+	int i, at;
+
+	/* repeats of repeats of nothing would take long, without emitting anything */
+	if(++p->work > 4L * REGEX_MAXPROG || p->nprog > REGEX_MAXPROG){
+		errno = EINVAL;
+		return -1;
+	}
+
+	switch(node->type){
+		case N_EMPTY:
+			return 0;
+
+		case N_CLASS:
+			return emit(p, I_CLASS, node->arg, 0) == -1 ? -1 : 0;
+
+		case N_ASSERT:
+			if((at = emit(p, I_ASSERT, 0, 0)) == -1)
+				return -1;
+			p->prog[at].arg = p->reverse ? mirror(node->arg) : node->arg;
+			return 0;
+
+		case N_CAT:
+			if(p->reverse)
+				return compile(p, node->r) || compile(p, p->nodes[n].l) ? -1 : 0;
+			return compile(p, node->l) || compile(p, p->nodes[n].r) ? -1 : 0;
+
+		case N_ALT:
+		{
+			int jmp;
+
+			if((at = emit(p, I_SPLIT, 0, 0)) == -1)
+				return -1;
+			p->prog[at].x = at + 1;
+			if(compile(p, p->nodes[n].l) || (jmp = emit(p, I_JMP, 0, 0)) == -1)
+				return -1;
+			p->prog[at].y = p->nprog;
+			if(compile(p, p->nodes[n].r))
+				return -1;
+			p->prog[jmp].x = p->nprog;
+			return 0;
+		}
+
+		case N_REPEAT:
+		{
+			const int l = node->l, min = node->min, max = node->max;
+
+			for(i = 0; i < min; i++)
+				if(compile(p, l))
+					return -1;
+
+			if(max == -1){
+				/* split: body, out - body: ... jmp split */
+				if((at = emit(p, I_SPLIT, 0, 0)) == -1)
+					return -1;
+				p->prog[at].x = at + 1;
+				if(compile(p, l) || emit(p, I_JMP, at, 0) == -1)
+					return -1;
+				p->prog[at].y = p->nprog;
+				return 0;
+			}
+
+			for(i = min; i < max; i++){
+				if((at = emit(p, I_SPLIT, 0, 0)) == -1)
+					return -1;
+				p->prog[at].x = at + 1;
+				if(compile(p, l))
+					return -1;
+				p->prog[at].y = p->nprog;
+			}
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+/* the instructions from root, one way or the other - NULL, with errno set, on error */
+static struct regex *build(struct parse *p, int root)
+{
+	struct regex *r;
+	int i;
+
+	p->nprog = p->aprog = 0;
+	p->work = 0;
+	if(compile(p, root) || emit(p, I_MATCH, 0, 0) == -1)
+		return NULL;
+
+	if(!(r = malloc(sizeof *r)))
+		goto nomem;
+	memset(r, '\0', sizeof *r);
+
+	r->prog  = p->prog;
+	r->nprog = p->nprog;
+	r->ncls  = p->ncls;
+	r->utf8  = p->utf8;
+	p->prog = NULL;
+
+	for(i = 0; i < r->nprog; i++)
+		if(r->prog[i].op == I_ASSERT)
+			r->ctxmask |= r->prog[i].arg == A_BOL ? C_BOL :
+				r->prog[i].arg == A_EOL ? 0 : C_PREVW;
+
+	r->cls   = malloc(r->ncls * sizeof *r->cls);
+	r->mark  = calloc(r->nprog, sizeof *r->mark);
+	r->stack = malloc(r->nprog * sizeof *r->stack);
+	r->set   = malloc(2 * r->nprog * sizeof *r->set);
+	r->set2  = malloc(2 * r->nprog * sizeof *r->set2);
+	if(!r->cls || !r->mark || !r->stack || !r->set || !r->set2)
+		goto nomem;
+	memcpy(r->cls, p->cls, r->ncls * sizeof *r->cls);
+
+	firstbytes(r);
 	return r;
-membail:
+
+nomem:
+	regex_free(r);
+	free(p->prog);
+	p->prog = NULL;
 	errno = ENOMEM;
+	return NULL;
+}
+
+struct regex *regex_create(const char *pat, int flags)
+{
+	struct regex *r = NULL;
+	struct parse p;
+	int root;
+
+	memset(&p, '\0', sizeof p);
+	p.s = pat;
+	p.icase = !!(flags & REGEX_ICASE);
+
+	if((p.utf8 = locale_utf8()) == -1){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if((root = parse_alt(&p)) == -1)
+		goto bail;
+	if(*p.s){
+		/* a ')' with no '(' */
+		errno = EINVAL;
+		goto bail;
+	}
+
+	if(!(r = build(&p, root)))
+		goto bail;
+	p.reverse = 1;
+	if(!(r->rev = build(&p, root)))
+		goto bail;
+
+	free(p.nodes);
+	free(p.cls);
+	return r;
+
+bail:
 	regex_free(r);
+	free(p.nodes);
+	free(p.cls);
+	free(p.prog);
 	return NULL;
 }
 
-/* 1 matches on 2 starting at 3, ending at 4 */
-int regex_matches(regex_t *r, const char *s, int *start, int *end)
+static void dfa_flush(struct regex *r)
 {
-	char *nodepos;
-	int i = strlen(nodepos) - 1;
+	struct dstate *d, *next;
 
-try:
-	nodepos = r->str;
+	for(d = r->states; d; d = next){
+		next = d->all;
+		free(d);
+	}
 
-	do{
-		if(*s == *nodepos){
-			nodepos++;
-			s++;
-		}else
-			return 0;
-		i--;
+	r->states = NULL;
+	memset(r->htab, '\0', sizeof r->htab);
+	memset(r->start, '\0', sizeof r->start);
+	r->dead = NULL;
+	r->nstates = 0;
+	r->flushes++;
+}
+
+void regex_free(struct regex *r)
+{
+	if(r){
+		regex_free(r->rev);
+		dfa_flush(r);
+		free(r->prog);
+		free(r->cls);
+		free(r->mark);
+		free(r->stack);
+		free(r->set);
+		free(r->set2);
+		free(r);
+	}
+}
+
+static unsigned int newgen(struct regex *r)
+{
+	if(++r->gen == 0){
+		memset(r->mark, '\0', r->nprog * sizeof *r->mark);
+		r->gen = 1;
 	}
+	return r->gen;
+}
 
-	switch(r->noderepeat){
-		case NONE:
-			return *s == *nodepos;
+static int context(const char *s, int pos, int len)
+{
+	return (pos == 0 ? C_BOL : 0)
+		| (pos == len ? C_EOL : 0)
+		| (pos > 0 && isword((unsigned char)s[pos - 1]) ? C_PREVW : 0)
+		| (pos < len && isword((unsigned char)s[pos]) ? C_NEXTW : 0);
+}
 
-		case STAR:
-			while(*s == *nodepos){
-				s++;
-				nodepos++;
+static int assert_ok(int a, int ctx)
+{
+	const int prev = !!(ctx & C_PREVW), next = !!(ctx & C_NEXTW);
+
+	switch(a){
+		case A_BOL:       return ctx & C_BOL;
+		case A_EOL:       return ctx & C_EOL;
+		case A_WORD:      return prev != next;
+		case A_NOTWORD:   return prev == next;
+		case A_WORDSTART: return !prev && next;
+		case A_WORDEND:   return prev && !next;
+	}
+	return 0;
+}
+
+/*
+ * add to set what's reachable from pc without consuming anything -
+ * through assertions too, if ctx is known (not -1). r->mark must be
+ * r->gen for what's in set already
+ */
+static void closure(struct regex *r, int pc, int ctx, int *set, int *n)
+{
+	int sp = 0;
+
+	if(r->mark[pc] == r->gen)
+		return;
+	r->mark[pc] = r->gen;
+	r->stack[sp++] = pc;
+
+	while(sp){
+		const struct inst *in = &r->prog[pc = r->stack[--sp]];
+		int to[2], nto = 0;
+
+		switch(in->op){
+			case I_JMP:
+				to[nto++] = in->x;
+				break;
+			case I_SPLIT:
+				to[nto++] = in->y;
+				to[nto++] = in->x;
+				break;
+			case I_ASSERT:
+				if(ctx != -1){
+					if(assert_ok(in->arg, ctx))
+						to[nto++] = pc + 1;
+					break;
+				}
+				/* fall through - kept, until what's next is known */
+			default:
+				set[(*n)++] = pc;
+		}
+
+		while(nto--)
+			if(r->mark[to[nto]] != r->gen){
+				r->mark[to[nto]] = r->gen;
+				r->stack[sp++] = to[nto];
 			}
-			if(*nodepos == '\0')
-			break;
+	}
+}
 
+/* what a match can start with, in any context - and whether only at the beginning */
+static void firstbytes(struct regex *r)
+{
+	int ctx, i, j, n;
 
-	return 1;
+	r->bol = 1;
+	for(ctx = 0; ctx <= (C_BOL | C_EOL | C_PREVW | C_NEXTW); ctx++){
+		n = 0;
+		newgen(r);
+		closure(r, 0, ctx, r->set, &n);
+
+		if(n && !(ctx & C_BOL))
+			r->bol = 0;
+
+		for(i = 0; i < n; i++){
+			const struct inst *in = &r->prog[r->set[i]];
+
+			if(in->op == I_MATCH)
+				r->empty = 1;
+			else
+				for(j = 0; j < (int)sizeof r->first; j++)
+					r->first[j] |= r->cls[in->x][j];
+		}
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* the state for set (which is sorted), made if need be - NULL if out of memory */
+static struct dstate *dfa_state(struct regex *r, const int *set, int n, int ctx)
+{
+	unsigned long h = 2166136261UL ^ (unsigned long)ctx;
+	struct dstate *d;
+	int i;
+
+	for(i = 0; i < n; i++)
+		h = (h ^ (unsigned long)set[i]) * 16777619UL;
+	h %= REGEX_HASH;
+
+	for(d = r->htab[h]; d; d = d->hnext)
+		if(d->ctx == ctx && d->npcs == n && !memcmp(d->pcs, set, n * sizeof *set))
+			return d;
+
+	if(r->nstates == REGEX_MAXSTATES)
+		dfa_flush(r);
+
+	if(!(d = malloc(sizeof *d + (n ? n - 1 : 0) * sizeof *d->pcs)))
+		return NULL;
+	memset(d, '\0', sizeof *d);
+
+	d->acceot = -1;
+	d->ctx = ctx;
+	d->npcs = n;
+	memcpy(d->pcs, set, n * sizeof *set);
+
+	if(!n && ctx == C_ANCHORED)
+		r->dead = d;
+
+	d->hnext = r->htab[h];
+	r->htab[h] = d;
+	d->all = r->states;
+	r->states = d;
+	r->nstates++;
+
+	return d;
+}
+
+/*
+ * what's before byte c (-1 for the end) at d: *acc, whether a match
+ * ends there, and the state after c. unless anchored, a match can start
+ * here (if start is set), so the start of the program is there too, as
+ * the last group. once one group matches, those after it start later,
+ * so they're dropped, and no more are started
+ */
+static struct dstate *dfa_step(struct regex *r, struct dstate *d, int c, int start, int *acc)
+{
+	const int ctx = d->ctx
+		| (c == -1 ? C_EOL : 0)
+		| (c != -1 && isword(c) ? C_NEXTW : 0);
+	const int anchored = d->ctx & C_ANCHORED;
+	const unsigned long flushes = r->flushes;
+	struct dstate *next;
+	int *set = r->set, n = 0, i, n2 = 0, g, nctx;
+
+	/* an instruction in two groups only needs to be in the earlier one */
+	newgen(r);
+	for(i = 0; i < d->npcs; i++)
+		if(d->pcs[i] != -1)
+			closure(r, d->pcs[i], ctx, set, &n);
+		else if(n && set[n - 1] != -1)
+			set[n++] = -1;
+	if(!anchored && start){
+		if(n && set[n - 1] != -1)
+			set[n++] = -1;
+		closure(r, 0, ctx, set, &n);
+	}
+	if(n && set[n - 1] == -1)
+		n--;
+
+	*acc = 0;
+	for(i = 0; i < n; i++)
+		if(set[i] != -1 && r->prog[set[i]].op == I_MATCH){
+			*acc = 1;
+			while(i < n && set[i] != -1)
+				i++;
+			n = i;
+		}
+
+	if(c == -1){
+		d->acceot = *acc;
+		return NULL;
+	}
+
+	newgen(r);
+	for(i = g = 0; i <= n; i++){
+		if(i < n && set[i] != -1){
+			const struct inst *in = &r->prog[set[i]];
+
+			if(in->op == I_CLASS && SET_HAS(r->cls[in->x], c))
+				closure(r, set[i] + 1, -1, r->set2, &n2);
+			continue;
+		}
+
+		/* the end of a group */
+		qsort(r->set2 + g, n2 - g, sizeof *r->set2, cmp_int);
+		if(n2 > g)
+			r->set2[n2++] = -1;
+		g = n2;
+	}
+	if(n2)
+		n2--;
+
+	/* with nothing going, and nothing more to start, what was before doesn't matter */
+	nctx = anchored || *acc ? C_ANCHORED : 0;
+	if(n2 || !nctx)
+		nctx |= (isword(c) ? C_PREVW : 0) & r->ctxmask;
+	if(!(next = dfa_state(r, r->set2, n2, nctx)))
+		return NULL;
+
+	/* unless d has gone, to make room - or this isn't what's usual before c */
+	if(r->flushes == flushes && (anchored || start == STARTS_BEFORE(r, c))){
+		d->next[c] = next;
+		if(*acc)
+			SET_ADD(d->acc, c);
+	}
+	return next;
+}
+
+/* as dfa_step(), but from d->next[] if it's been done before */
+static struct dstate *dfa_next(struct regex *r, struct dstate *d, int c, int start, int *acc)
+{
+	struct dstate *next;
+
+	if(c == -1){
+		if(d->acceot == -1)
+			dfa_step(r, d, -1, 1, acc);
+		*acc = d->acceot;
+		return NULL;
+	}
+
+	if((next = d->next[c]) && (d->ctx & C_ANCHORED || start == STARTS_BEFORE(r, c))){
+		*acc = !!SET_HAS(d->acc, c);
+		return next;
+	}
+	return dfa_step(r, d, c, start, acc);
 }
 
-void regex_free(regex_t *r)
+/* the state r starts in, in ctx - with nothing in it, unless anchored */
+static struct dstate *dfa_start(struct regex *r, int ctx)
 {
-	while(r){
-		regex_t *tmp = r;
-		r = r->next;
+	struct dstate *d;
 
-		free(tmp->str);
-		free(tmp);
+	if(!(d = r->start[ctx])){
+		r->set2[0] = 0;
+		d = r->start[ctx] = dfa_state(r, r->set2, !!(ctx & C_ANCHORED), ctx);
 	}
+	return d;
+}
+
+/* d, with no more matches to start - NULL if out of memory */
+static struct dstate *dfa_anchor(struct regex *r, struct dstate *d)
+{
+	/* d could go, to make room */
+	memcpy(r->set2, d->pcs, d->npcs * sizeof *d->pcs);
+	return dfa_state(r, r->set2, d->npcs, d->npcs ? d->ctx | C_ANCHORED : C_ANCHORED);
+}
+
+/*
+ * *end is where the leftmost longest match in s[from, len) starting at
+ * or before to ends, found going forwards from from - 1 if there's one,
+ * 0 if not, -1 if out of memory. it only goes as far as the longest
+ * match from where the leftmost starts could go
+ */
+static int dfa_first(struct regex *r, const char *s, int from, int to, int len, int *end)
+{
+	struct dstate *d;
+	int i, acc;
+
+	if(!(d = dfa_start(r, context(s, from, len) & r->ctxmask)))
+		return -1;
+
+	*end = -1;
+	for(i = from; i < len; i++){
+		struct dstate *next;
+		int c;
+
+		if(i > to && !(d->ctx & C_ANCHORED) && !(d = dfa_anchor(r, d)))
+			return -1;
+
+		/* nothing going, so nothing happens until something could start */
+		if(!r->empty && !d->npcs && !(d->ctx & C_ANCHORED) && !SET_HAS(r->first, s[i])){
+			while(++i < len && !SET_HAS(r->first, s[i]))
+				;
+			if(i == len || i > to)
+				return 0;
+			if(!(d = dfa_start(r, context(s, i, len) & r->ctxmask)))
+				return -1;
+		}
+
+		/* a character that isn't whole can't be in one, so a match can start in it */
+		c = (unsigned char)s[i];
+		if(!STARTS_BEFORE(r, c) && !(d->ctx & C_ANCHORED) && utf8_boundary(s, i, len)){
+			if(!(next = dfa_step(r, d, c, 1, &acc)))
+				return -1;
+		}else if((next = d->next[c])){
+			acc = SET_HAS(d->acc, c);
+		}else if(!(next = dfa_step(r, d, c, STARTS_BEFORE(r, c), &acc))){
+			return -1;
+		}
+		if(acc)
+			*end = i;
+
+		/* nothing left that could match, and nothing more to start */
+		if(next == r->dead)
+			return *end != -1;
+		d = next;
+	}
+
+	/* or a match at the end */
+	if(len > to && !(d->ctx & C_ANCHORED) && !(d = dfa_anchor(r, d)))
+		return -1;
+	dfa_next(r, d, -1, 1, &acc);
+	if(acc)
+		*end = len;
+
+	return *end != -1;
+}
+
+/*
+ * *start is where the longest match ending at end starts, at or after
+ * from, found going backwards from end - 0 if there isn't one, -1 if out
+ * of memory
+ */
+static int dfa_begin(struct regex *r, const char *s, int from, int end, int len, int *start)
+{
+	struct regex *rev = r->rev;
+	struct dstate *d;
+	int i, acc;
+
+	/* the end is rev's beginning */
+	if(!(d = dfa_start(rev, (((end == len ? C_BOL : 0)
+			| (end < len && isword((unsigned char)s[end]) ? C_PREVW : 0)) & rev->ctxmask) | C_ANCHORED)))
+		return -1;
+
+	*start = -1;
+	for(i = end; i > from; i--){
+		const unsigned char c = s[i - 1];
+		struct dstate *next;
+
+		if((next = d->next[c]))
+			acc = SET_HAS(d->acc, c);
+		else if(!(next = dfa_step(rev, d, c, 1, &acc)))
+			return -1;
+
+		/* in UTF-8, matches start at characters, not in them */
+		if(acc && (!r->utf8 || utf8_boundary(s, i, len)))
+			*start = i;
+
+		/* nothing left that could match */
+		if(!next->npcs)
+			return *start != -1;
+		d = next;
+	}
+
+	/* what's before from still counts, for assertions */
+	if(!dfa_next(rev, d, from > 0 ? (unsigned char)s[from - 1] : -1, 1, &acc) && from > 0)
+		return -1;
+	if(acc && (!r->utf8 || utf8_boundary(s, from, len)))
+		*start = from;
+
+	return *start != -1;
+}
+
+/* *end is where the longest match from start ends - 0 if there isn't one, -1 if out of memory */
+static int dfa_end(struct regex *r, const char *s, int start, int len, int *end)
+{
+	struct dstate *d;
+	int i;
+
+	if(!(d = dfa_start(r, (context(s, start, len) & r->ctxmask) | C_ANCHORED)))
+		return -1;
+
+	*end = -1;
+	for(i = start; ; i++){
+		const int c = i < len ? (unsigned char)s[i] : -1;
+		struct dstate *next;
+		int acc;
+
+		if(!(next = dfa_next(r, d, c, 1, &acc)) && c != -1)
+			return -1;
+		if(acc)
+			*end = i;
+
+		/* nothing left that could match */
+		if(c == -1 || !next->npcs)
+			break;
+		d = next;
+	}
+
+	return *end != -1;
+}
+
+int regex_matches_before(struct regex *r, const char *s, int from, int to, int len, int *start, int *end)
+{
+	int ret;
+
+	if(from > len || from > to)
+		return 0;
+
+	/* no need to look for where it starts */
+	if(r->bol){
+		*start = 0;
+		return from ? 0 : dfa_end(r, s, 0, len, end);
+	}
+
+	/* where it ends first, so going back to where it starts goes no further than it has to */
+	if((ret = dfa_first(r, s, from, to, len, end)) != 1)
+		return ret;
+	return dfa_begin(r, s, from, *end, len, start);
+}
+
+int regex_matches(struct regex *r, const char *s, int from, int len, int *start, int *end)
+{
+	return regex_matches_before(r, s, from, len, len, start, end);
 }
@@ -1,17 +1,39 @@
 #ifndef REGEX_H
 #define REGEX_H
 
-typedef struct _regex
-	{
-		char *str;
-		enum { NONE, STAR, PLUS, QMARK } noderepeat;
-		struct _regex *next;
-	} regex_t;
+/*
+ * uvi's own regex engine - POSIX extended regexes, matched in time
+ * linear in the text. the pattern is compiled to a Thompson NFA, which
+ * is run as a DFA, built lazily - forwards over the text, to find where
+ * the leftmost longest match ends if there's one at all, then backwards
+ * from there to find where it starts. neither goes further than the
+ * match does, so walking the matches along a line is linear too
+ *
+ * backreferences aren't regular, so aren't handled, and neither are the
+ * GNU extensions other than \< \> \b \B \w \W \s \S. in a UTF-8 locale,
+ * '.' and [^...] match whole characters, but what else depends on the
+ * locale - classes, word boundaries, and case folding beyond ASCII -
+ * isn't handled. regex_create() gives NULL with errno EINVAL for all of
+ * these, and the caller can use regcomp() instead
+ *
+ * a regex mustn't be used from two threads at once
+ */
 
+#define REGEX_ICASE 1
 
-regex_t *regex_create(const char *);
-int      regex_matches(regex_t *, const char *, int *, int *);
-/* 1 matches on 2 starting at 3, ending at 4 */
-void     regex_free(regex_t *);
+struct regex;
+
+struct regex *regex_create(const char *, int flags); /* NULL, with errno set, on error */
+void          regex_free(struct regex *);
+
+/*
+ * 1 if r matches in s[from, len), setting [*start, *end) to the leftmost
+ * longest match, 0 if not, or -1 if out of memory. what's before from is
+ * still looked at by ^ \< \> \b and \B, as with REG_STARTEND
+ */
+int regex_matches(struct regex *, const char *s, int from, int len, int *start, int *end);
+
+/* the same, but for matches starting at or before to - it needn't look much further */
+int regex_matches_before(struct regex *, const char *s, int from, int to, int len, int *start, int *end);
 
 #endif
@@ -1,29 +1,221 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <errno.h>
+#include <wchar.h>
+#include <regex.h>
+#include <time.h>
 
 #include "regex.h"
 
-int main(void)
+/*
+ * regex_matches() against regexec(), which is taken to be right - on
+ * patterns and text made up at random from pieces likely to go wrong,
+ * then on some that would take a backtracking matcher forever
+ */
+
+static const char *const atoms[] = {
+	"a", "b", "A", "c", "_", " ", ".", "*", "+", "?", "|", "(", ")",
+	"[ab]", "[^a]", "[a-c]", "[]a]", "[[:alpha:]]", "[[:digit:]x]", "[^[:space:]]",
+	"^", "$", "\\.", "\\<", "\\>", "\\b", "\\w", "\\W", "\\s",
+	"{2}", "{1,2}", "{0,}", "ab", "bc", "()", "\xc3\xa9",
+};
+
+static const char *const bytes[] = {
+	"a", "A", "b", "B", "c", "_", " ", ".", "x", "1", "\xc3\xa9", "\xc3", "\xa9", "\xe2\x82\xac",
+};
+
+#define NATOMS (int)(sizeof atoms / sizeof *atoms)
+#define NBYTES (int)(sizeof bytes / sizeof *bytes)
+
+static int fails, tested, fallbacks;
+
+static void check(const char *pat, int icase, const char *s, int from)
+{
+	const int len = strlen(s);
+	struct regex *r;
+	regex_t re;
+	regmatch_t m;
+	int ret, start = -1, end = -1, want, to;
+
+	if(regcomp(&re, pat, REG_EXTENDED | (icase ? REG_ICASE : 0)))
+		return;
+
+	if(!(r = regex_create(pat, icase ? REGEX_ICASE : 0))){
+		if(errno != EINVAL){
+			printf("FAIL: /%s/: %s\n", pat, strerror(errno));
+			fails++;
+		}
+		fallbacks++;
+		regfree(&re);
+		return;
+	}
+
+	m.rm_so = from;
+	m.rm_eo = len;
+	want = !regexec(&re, s, 1, &m, REG_STARTEND);
+	ret = regex_matches(r, s, from, len, &start, &end);
+
+	if(ret != want || (want && (start != m.rm_so || end != m.rm_eo))){
+		printf("FAIL: /%s/%s on \"%s\" from %d: got %d [%d, %d), want %d [%d, %d)\n",
+				pat, icase ? "i" : "", s, from,
+				ret, start, end, want, (int)m.rm_so, (int)m.rm_eo);
+		fails++;
+	}
+	tested++;
+
+	/* and only up to somewhere - it's the same match, if it starts soon enough */
+	to = from + rand() % (len - from + 1);
+	ret = regex_matches_before(r, s, from, to, len, &start, &end);
+	want = want && m.rm_so <= to;
+
+	if(ret != want || (want && (start != m.rm_so || end != m.rm_eo))){
+		printf("FAIL: /%s/%s on \"%s\" from %d to %d: got %d [%d, %d), want %d [%d, %d)\n",
+				pat, icase ? "i" : "", s, from, to,
+				ret, start, end, want, (int)m.rm_so, (int)m.rm_eo);
+		fails++;
+	}
+
+	regex_free(r);
+	regfree(&re);
+}
+
+/*
+ * glibc isn't consistent about where it starts from the middle of a
+ * character, so from is moved back to where the character starts
+ */
+static int char_start(const char *s, int from)
 {
-	const char *regex = "he?ll*o the+re";
-	regex_t *reg, *r;
-	int indent = 0, i;
+	mbstate_t st;
+	int i = 0;
 
-#define INDENT() for(i = 0; i < indent; i++) putchar(' ');
+	memset(&st, '\0', sizeof st);
+	while(s[i]){
+		size_t n = mbrlen(s + i, strlen(s + i), &st);
 
-	r = reg = regex_create(regex);
+		if(n == (size_t)-1 || n == (size_t)-2){
+			memset(&st, '\0', sizeof st);
+			n = 1;
+		}
+		if(i + (int)n > from)
+			break;
+		i += n;
+	}
+	return i;
+}
 
-	while(r){
-		INDENT();
-		printf("r->str: %s\n", r->str);
-		INDENT();
-		printf("r->noderepeat: %s\n", r->noderepeat == NONE ? "none" : r->noderepeat == STAR ? "star" : r->noderepeat == QMARK ? "qmark" : "plus");
-		INDENT();
-		printf("r->next:\n");
-		indent++;
+static void random_tests(int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++){
+		char pat[128], s[128];
+		int j, natoms = 1 + rand() % 6, nbytes = rand() % 16;
+
+		*pat = *s = '\0';
+		for(j = 0; j < natoms; j++)
+			strcat(pat, atoms[rand() % NATOMS]);
+		for(j = 0; j < nbytes; j++)
+			strcat(s, bytes[rand() % NBYTES]);
 
-		r = r->next;
+		check(pat, rand() % 2, s, char_start(s, strlen(s) ? rand() % (strlen(s) + 1) : 0));
 	}
+}
+
+/* glibc gets \B wrong after a repeat ("c*\B" matches at the end of "bc"), so it's only tried alone */
+static void nonboundary_tests(void)
+{
+	static const char *const pats[] = { "\\B", "a\\B", "\\Bb", "\\B_", " \\B", "\\B\\.", "(a|\\B)" };
+	static const char *const strs[] = { "", "a", "ab", "a b", "_a.", " . ", "ba_ b" };
+	unsigned int i, j;
+	int from;
+
+	for(i = 0; i < sizeof pats / sizeof *pats; i++)
+		for(j = 0; j < sizeof strs / sizeof *strs; j++)
+			for(from = 0; from <= (int)strlen(strs[j]); from++)
+				check(pats[i], 0, strs[j], from);
+}
+
+/* these are exponential for backtracking - they have to finish at all */
+static void slow_tests(void)
+{
+	static const char *const pats[] = { "(a|aa)*c", "(a*)*b", "(x+x+)+y", "(a|a?)+$b" };
+	static char s[100001];
+	unsigned int i;
+
+	memset(s, 'a', sizeof s - 1);
+
+	for(i = 0; i < sizeof pats / sizeof *pats; i++){
+		struct regex *r = regex_create(pats[i], 0);
+		int start, end;
+
+		if(!r || regex_matches(r, s, 0, sizeof s - 1, &start, &end) != 0){
+			printf("FAIL: /%s/ on a long line\n", pats[i]);
+			fails++;
+		}
+		regex_free(r);
+	}
+}
+
+/*
+ * each match along a long line - a search shouldn't look at the rest
+ * of the line once it has its match, or this is quadratic
+ */
+static void walk_tests(void)
+{
+	static const char *const pats[] = { "a[bc]", "\\<a", "(ab|b)c*", "x*" };
+	static char s[200001];
+	unsigned int i, j;
+
+	for(j = 0; j < sizeof s - 1; j++)
+		s[j] = "abc "[j % 4];
+
+	/* where \< is handled */
+	setlocale(LC_ALL, "C");
+
+	for(i = 0; i < sizeof pats / sizeof *pats; i++){
+		struct regex *r = regex_create(pats[i], 0);
+		clock_t t = clock();
+		int from = 0, start, end, n = 0;
+
+		while(r && regex_matches(r, s, from, sizeof s - 1, &start, &end) == 1){
+			n++;
+			from = end > start ? end : start + 1;
+		}
+
+		if(!r || !n || clock() - t > CLOCKS_PER_SEC){
+			printf("FAIL: /%s/ walked along a long line, %d matches in %.1fs\n",
+					pats[i], n, (clock() - t) / (double)CLOCKS_PER_SEC);
+			fails++;
+		}
+		regex_free(r);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const int n = argc > 1 ? atoi(argv[1]) : 100000;
+	static const char *const locales[] = { "C", "C.UTF-8" };
+	unsigned int i;
+
+	srand(1);
+
+	for(i = 0; i < sizeof locales / sizeof *locales; i++){
+		if(!setlocale(LC_ALL, locales[i])){
+			printf("%s: not available\n", locales[i]);
+			continue;
+		}
+
+		tested = fallbacks = 0;
+		random_tests(n);
+		nonboundary_tests();
+		printf("%s: %d compared, %d left to regcomp()\n", locales[i], tested, fallbacks);
+	}
+
+	slow_tests();
+	walk_tests();
 
-	regex_free(reg);
-	return 0;
+	printf("%d failed\n", fails);
+	return !!fails;
 }
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "range.h"
+#include "util/list.h"
+#include "buffer.h"
+#include "global.h"
+#include "journal.h"
+#include "recover.h"
+
+/*
+ * what of the buffer can be tried without a terminal - files are made
+ * in a directory of their own, which is $HOME too, for the journal
+ */
+
+static char dir[] = "/tmp/uvi-test.XXXXXX";
+static int fails;
+
+#define CHECK(x) do{ \
+		if(!(x)){ \
+			printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #x); \
+			fails++; \
+		} \
+	}while(0)
+
+void die(const char *fmt, ...)
+{
+	va_list l;
+
+	printf("uvi: dying: ");
+	va_start(l, fmt);
+	vprintf(fmt, l);
+	va_end(l);
+	putchar('\n');
+
+	abort();
+}
+
+/* the buffer for a file holding len bytes of s */
+static buffer_t *file(const char *name, const char *s, size_t len)
+{
+	char path[sizeof dir + 32];
+	buffer_t *b;
+	FILE *f;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	if(!(f = fopen(path, "w+")) || fwrite(s, 1, len, f) != len || fseek(f, 0, SEEK_SET))
+		die("%s: can't write", path);
+	if(buffer_read(&b, f) == -1)
+		die("%s: can't read", path);
+	fclose(f);
+
+	buffer_setfilename(b, path);
+	return b;
+}
+
+static int line_is(buffer_t *b, int y, const char *s, int len)
+{
+	struct list *l = buffer_getindex(b, y);
+
+	return l && buffer_line_len(l) == len && !memcmp(l->data, s, len + 1);
+}
+
+/* a line with a '\0' in it comes back from the journal whole */
+static void journal_tests(void)
+{
+	buffer_t *b = file("nul", "one\nt\0wo\n", 9);
+	int y = -1;
+
+	global_settings.journal = 1;
+
+	CHECK(line_is(b, 1, "t\0wo", 4));
+	buffer_line_delete(b, buffer_getindex(b, 1), 1, 1);
+	CHECK(line_is(b, 1, "two", 3));
+	CHECK(buffer_write(b) != -1);
+
+	CHECK(journal_earlier(b, 1, &y) == 1);
+	CHECK(y == 1);
+	CHECK(buffer_nlines(b) == 2);
+	CHECK(line_is(b, 0, "one", 3));
+	CHECK(line_is(b, 1, "t\0wo", 4));
+
+	buffer_free(b);
+}
+
+static int snapline_is(const struct snapshot *snap, int y, const char *s, int len)
+{
+	int n;
+	const char *l = snapshot_line(snap, y, &n);
+
+	return n == len && !memcmp(l, s, len + 1);
+}
+
+/* a snapshot stays as it was taken, however the buffer changes after */
+static void snapshot_tests(void)
+{
+	buffer_t *b = file("snap", "one\ntwo\nthree\n", 14);
+	struct snapshot *s1, *s2;
+	struct range r = { 2, 2 };
+
+	s1 = buffer_snapshot(b);
+	CHECK(buffer_snapshot(b) == s1);
+	snapshot_free(s1);
+
+	buffer_line_insert(b, buffer_getindex(b, 0), 3, "!", 1);
+	buffer_line_delete(b, buffer_getindex(b, 1), 0, 1);
+	buffer_insertafter(b, buffer_getindex(b, 0), strcpy(malloc(4), "new"));
+	buffer_remove_range(b, &r);
+
+	CHECK(snapshot_nlines(s1) == 3);
+	CHECK(snapline_is(s1, 0, "one", 3));
+	CHECK(snapline_is(s1, 1, "two", 3));
+	CHECK(snapline_is(s1, 2, "three", 5));
+
+	s2 = buffer_snapshot(b);
+	CHECK(s2 != s1);
+	CHECK(snapshot_nlines(s2) == 3);
+	CHECK(snapline_is(s2, 0, "one!", 4));
+	CHECK(snapline_is(s2, 1, "new", 3));
+	CHECK(snapline_is(s2, 2, "three", 5));
+
+	/* an edited line is copied by a snapshot, not shared with it */
+	buffer_line_insert(b, buffer_getindex(b, 0), 0, "?", 1);
+	CHECK(snapline_is(s2, 0, "one!", 4));
+	CHECK(line_is(b, 0, "?one!", 5));
+
+	/* what snapshots point into outlives the buffer */
+	buffer_free(b);
+	CHECK(snapline_is(s1, 2, "three", 5));
+	CHECK(snapline_is(s2, 2, "three", 5));
+	snapshot_free(s1);
+	snapshot_free(s2);
+}
+
+/* a snapshot of a file still loading has the lines loaded so far */
+static void snapshot_lazy_tests(void)
+{
+	const int n = 1 << 20; /* twice a block */
+	char *s = malloc(2 * n), path[sizeof dir + 32];
+	struct snapshot *snap;
+	buffer_t *b;
+	FILE *f;
+	int i, y;
+
+	for(i = 0; i < n; i++)
+		memcpy(s + 2 * i, "x\n", 2);
+	snprintf(path, sizeof path, "%s/lazy", dir);
+	if(!(f = fopen(path, "w+")) || fwrite(s, 1, 2 * n, f) != (size_t)2 * n || fseek(f, 0, SEEK_SET))
+		die("%s: can't write", path);
+	free(s);
+
+	CHECK(buffer_read_lazy(&b, f) != -1);
+	fclose(f);
+
+	snap = buffer_snapshot(b);
+	CHECK(buffer_loading(b));
+	CHECK(!snapshot_complete(snap));
+	CHECK((y = snapshot_nlines(snap)) == buffer_nlines(b));
+	CHECK(y > 0 && y < n);
+
+	buffer_loadall(b);
+	buffer_line_insert(b, buffer_getindex(b, 0), 0, "y", 1);
+	CHECK(buffer_nlines(b) == n);
+	CHECK(snapshot_nlines(snap) == y);
+	CHECK(snapline_is(snap, 0, "x", 1));
+	snapshot_free(snap);
+
+	snap = buffer_snapshot(b);
+	CHECK(snapshot_complete(snap));
+	CHECK(snapshot_nlines(snap) == n);
+	CHECK(snapline_is(snap, 0, "yx", 2));
+	CHECK(snapline_is(snap, n - 1, "x", 1));
+
+	buffer_free(b);
+	snapshot_free(snap);
+}
+
+/* edits within lines are logged as what they changed, and replay as such */
+static void recover_tests(void)
+{
+	buffer_t *b = file("rec", "one\ntwo\nthree\n", 14), *b2;
+	struct list *l;
+	int stale = -1;
+	FILE *f;
+
+	global_settings.recover = 1;
+
+	buffer_line_insert(b, buffer_getindex(b, 0), 3, "!", 1);
+	buffer_line_delete(b, buffer_getindex(b, 1), 0, 1);
+	l = buffer_getindex(b, 2);
+	buffer_line_edit(b, l);
+	((char *)l->data)[2] = 'R';
+	buffer_line_changed(b, l, 5);
+	buffer_insertafter(b, buffer_getindex(b, 2), strcpy(malloc(4), "new"));
+
+	/* as a filter would */
+	l = list_new(strcpy(malloc(5), "one!"));
+	list_append(l, strcpy(malloc(3), "WO"));
+	list_append(l, strcpy(malloc(6), "thRee"));
+	list_append(l, strcpy(malloc(4), "new"));
+	buffer_replace(b, l);
+	CHECK(recover_flush(b) == 0);
+
+	if(!(f = fopen(buffer_filename(b), "r")) || buffer_read(&b2, f) == -1)
+		die("%s: can't read", buffer_filename(b));
+	fclose(f);
+	buffer_setfilename(b2, buffer_filename(b));
+
+	CHECK(recover_replay(b2, &stale) == 5);
+	CHECK(!stale);
+	CHECK(buffer_nlines(b2) == 4);
+	CHECK(line_is(b2, 0, "one!", 4));
+	CHECK(line_is(b2, 1, "WO", 2));
+	CHECK(line_is(b2, 2, "thRee", 5));
+	CHECK(line_is(b2, 3, "new", 3));
+
+	buffer_free(b);
+	buffer_free(b2);
+	global_settings.recover = 0;
+}
+
+int main(void)
+{
+	char cmd[sizeof dir + 16];
+
+	if(!mkdtemp(dir) || setenv("HOME", dir, 1)){
+		perror(dir);
+		return 1;
+	}
+
+	journal_tests();
+	snapshot_tests();
+	snapshot_lazy_tests();
+	recover_tests();
+
+	snprintf(cmd, sizeof cmd, "rm -rf %s", dir);
+	system(cmd);
+
+	printf("%d failed\n", fails);
+	return !!fails;
+}
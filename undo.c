@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/alloc.h"
+#include "util/str.h"
+#include "range.h"
+#include "util/list.h"
+#include "buffer.h"
+#include "global.h"
+#include "undo.h"
+
+struct delta
+{
+	struct delta *prev, *next;
+	enum { DELTA_LINES, DELTA_CHARS } type;
+	int y, x;
+	int nold, nnew; /* lines, or bytes */
+
+	/* the old text, then from split, the new - lines are each an int length, then that many bytes */
+	char *text;
+	size_t split, len, siz;
+};
+
+struct step
+{
+	struct step *prev, *next;
+	struct delta *first, *last;
+	size_t mem;
+};
+
+struct undo
+{
+	struct step *first, *last;
+	struct step *cur; /* the last step done - NULL if they've all been undone */
+	int open; /* whether changes still go into cur */
+	size_t mem;
+
+	int applying; /* don't record our own changes */
+	struct delta *building;
+
+	/* the line being changed in place, as it was */
+	char *edit;
+	int edit_y, edit_len;
+};
+
+#define DELTA_MEM(d) (sizeof *(d) + (d)->siz)
+
+static struct undo *undo_get(buffer_t *b)
+{
+	if(!global_settings.undomem || (b->undo && b->undo->applying))
+		return NULL;
+
+	if(!b->undo){
+		b->undo = umalloc(sizeof *b->undo);
+		memset(b->undo, '\0', sizeof *b->undo);
+	}
+	return b->undo;
+}
+
+static struct delta *delta_new(int type, int y, int x)
+{
+	struct delta *d = umalloc(sizeof *d);
+
+	memset(d, '\0', sizeof *d);
+	d->type = type;
+	d->y = y;
+	d->x = x;
+	return d;
+}
+
+static void delta_text(struct delta *d, const char *s, int len, int nul)
+{
+	const size_t need = d->len + len + nul;
+
+	if(need > d->siz){
+		d->siz = need > 2 * d->siz ? need : 2 * d->siz;
+		d->text = urealloc(d->text, d->siz);
+	}
+
+	if(len)
+		memcpy(d->text + d->len, s, len);
+	d->len += len;
+	if(nul)
+		d->text[d->len++] = '\0';
+}
+
+/* lines can have '\0's in them, so they're given lengths */
+static void delta_line(struct delta *d, const char *s, int len)
+{
+	delta_text(d, (const char *)&len, sizeof len, 0);
+	delta_text(d, s, len, 0);
+}
+
+static void step_free(struct step *s)
+{
+	struct delta *d, *next;
+
+	for(d = s->first; d; d = next){
+		next = d->next;
+		free(d->text);
+		free(d);
+	}
+	free(s);
+}
+
+/* the step to record into - a new one if the last has ended */
+static struct step *undo_step(struct undo *u)
+{
+	struct step *s, *next;
+
+	if(u->open)
+		return u->cur;
+
+	/* anything undone can't be redone now */
+	for(s = u->cur ? u->cur->next : u->first; s; s = next){
+		next = s->next;
+		u->mem -= s->mem;
+		step_free(s);
+	}
+
+	s = umalloc(sizeof *s);
+	memset(s, '\0', sizeof *s);
+	s->mem = sizeof *s;
+	u->mem += s->mem;
+
+	if((s->prev = u->cur))
+		u->cur->next = s;
+	else
+		u->first = s;
+	u->last = u->cur = s;
+	u->open = 1;
+
+	return s;
+}
+
+/* d's new side - what a change following on from d would have as its old */
+static const char *delta_new_side(struct delta *d, size_t *len)
+{
+	*len = d->len - d->split;
+	return d->text + d->split;
+}
+
+/* fold d into a, if d just carries on from it */
+static int delta_merge(struct delta *a, struct delta *d)
+{
+	size_t alen;
+	const char *anew;
+
+	if(a->type != d->type || a->y != d->y)
+		return 0;
+
+	anew = delta_new_side(a, &alen);
+
+	if(a->type == DELTA_LINES){
+		/* a's new lines are changed again (or deleted lines replaced) */
+		if(a->nnew != d->nold || d->split != alen || memcmp(anew, d->text, alen))
+			return 0;
+
+		a->len = a->split;
+		delta_text(a, d->text + d->split, d->len - d->split, 0);
+		a->nnew = d->nnew;
+		return 1;
+	}
+
+	if(!a->nold && !d->nold && d->x == a->x + a->nnew){
+		/* typed on from a */
+		delta_text(a, d->text, d->len, 0);
+		a->nnew += d->nnew;
+		return 1;
+	}
+	if(!a->nnew && !d->nnew && d->x == a->x){
+		/* deleted on from a */
+		delta_text(a, d->text, d->len, 0);
+		a->split = a->len;
+		a->nold += d->nold;
+		return 1;
+	}
+	return 0;
+}
+
+static void undo_add(struct undo *u, struct delta *d)
+{
+	struct step *s = undo_step(u);
+	struct delta *last = s->last;
+	size_t before;
+
+	if(last && (before = DELTA_MEM(last), delta_merge(last, d))){
+		u->mem += DELTA_MEM(last) - before;
+		s->mem += DELTA_MEM(last) - before;
+		free(d->text);
+		free(d);
+	}else{
+		if(d->siz > d->len){
+			/* they're kept a while - no need for the slack */
+			if(d->len){
+				d->text = urealloc(d->text, d->len);
+			}else{
+				free(d->text);
+				d->text = NULL;
+			}
+			d->siz = d->len;
+		}
+
+		if((d->prev = last))
+			last->next = d;
+		else
+			s->first = d;
+		s->last = d;
+
+		u->mem += DELTA_MEM(d);
+		s->mem += DELTA_MEM(d);
+	}
+
+	/* forget the oldest steps, to stay under undomem */
+	while(u->mem > (size_t)global_settings.undomem * 1024 * 1024 && u->first != u->cur){
+		struct step *old = u->first;
+
+		u->first = old->next;
+		u->first->prev = NULL;
+		u->mem -= old->mem;
+		step_free(old);
+	}
+}
+
+void undo_lines_begin(buffer_t *b, int y)
+{
+	struct undo *u = undo_get(b);
+
+	if(u)
+		u->building = delta_new(DELTA_LINES, y, 0);
+}
+
+void undo_lines_old(buffer_t *b, const char *s, int len)
+{
+	struct undo *u = undo_get(b);
+
+	if(u && u->building){
+		delta_line(u->building, s, len);
+		u->building->split = u->building->len;
+		u->building->nold++;
+	}
+}
+
+void undo_lines_new(buffer_t *b, const char *s, int len)
+{
+	struct undo *u = undo_get(b);
+
+	if(u && u->building){
+		delta_line(u->building, s, len);
+		u->building->nnew++;
+	}
+}
+
+void undo_lines_end(buffer_t *b)
+{
+	struct undo *u = undo_get(b);
+
+	if(u && u->building){
+		undo_add(u, u->building);
+		u->building = NULL;
+	}
+}
+
+void undo_chars(buffer_t *b, int y, int x,
+		const char *old, int nold, const char *new, int nnew)
+{
+	struct undo *u = undo_get(b);
+	struct delta *d;
+
+	if(!u || (!nold && !nnew))
+		return;
+
+	d = delta_new(DELTA_CHARS, y, x);
+	delta_text(d, old, nold, 0);
+	d->split = d->len;
+	delta_text(d, new, nnew, 0);
+	d->nold = nold;
+	d->nnew = nnew;
+
+	undo_add(u, d);
+}
+
+void undo_line_edit(buffer_t *b, int y, const char *s, int len)
+{
+	struct undo *u = undo_get(b);
+
+	if(!u || (u->edit && u->edit_y == y))
+		return;
+
+	free(u->edit);
+	u->edit = umalloc(len + 1);
+	memcpy(u->edit, s, len + 1);
+	u->edit_y = y;
+	u->edit_len = len;
+}
+
+void undo_line_changed(buffer_t *b, int y, const char *s, int len)
+{
+	struct undo *u = undo_get(b);
+
+	if(!u || !u->edit)
+		return;
+
+	if(u->edit_y != y){
+		/* s is some other line's - a bug, and nothing to record for edit_y */
+	}else if(u->edit_len == len && !memcmp(u->edit, s, len)){
+		/* nothing actually changed */
+	}else{
+		undo_lines_begin(b, u->edit_y);
+		undo_lines_old(b, u->edit, u->edit_len);
+		undo_lines_new(b, s, len);
+		undo_lines_end(b);
+	}
+
+	free(u->edit);
+	u->edit = NULL;
+}
+
+void undo_break(buffer_t *b)
+{
+	struct undo *u = b->undo;
+
+	if(u){
+		u->open = 0;
+		free(u->edit);
+		u->edit = NULL;
+	}
+}
+
+void undo_free(struct undo *u)
+{
+	struct step *s, *next;
+
+	if(!u)
+		return;
+
+	for(s = u->first; s; s = next){
+		next = s->next;
+		step_free(s);
+	}
+	free(u->edit);
+	free(u);
+}
+
+/* replace one side of d with the other */
+static void delta_apply(buffer_t *b, struct delta *d, int redo)
+{
+	const char *to = redo ? d->text + d->split : d->text;
+	const int nfrom = redo ? d->nold : d->nnew;
+	const int nto   = redo ? d->nnew : d->nold;
+
+	if(d->type == DELTA_LINES){
+		/* insert, then remove, so the buffer is never left empty */
+		if(nto){
+			struct list *l, *tail;
+			int i;
+
+			/* shared, as that's how lines are given with their lengths */
+			tail = l = list_new(NULL);
+			for(i = 0; i < nto; i++){
+				int len;
+
+				memcpy(&len, to, sizeof len);
+				to += sizeof len;
+				list_append(tail, str_share(to, len));
+				tail = list_gettail(tail);
+				to += len;
+			}
+
+			if(d->y + nfrom < buffer_nlines(b))
+				buffer_sharelistbefore(b, buffer_getindex(b, d->y + nfrom), l);
+			else
+				buffer_sharelistafter(b, buffer_gettail(b), l);
+			list_free(l, str_unref);
+		}
+
+		if(nfrom){
+			struct range r;
+
+			r.start = d->y;
+			r.end   = d->y + nfrom - 1;
+			buffer_remove_range(b, &r);
+		}
+	}else{
+		struct list *l = buffer_getindex(b, d->y);
+
+		buffer_line_delete(b, l, d->x, nfrom);
+		buffer_line_insert(b, l, d->x, to, nto);
+	}
+}
+
+static void undo_apply(buffer_t *b, struct step *s, int redo, int *y, int *x)
+{
+	struct undo *u = b->undo;
+	struct delta *d;
+
+	u->open = 0;
+	u->applying = 1;
+
+	if(redo)
+		for(d = s->first; d; d = d->next)
+			delta_apply(b, d, 1);
+	else
+		for(d = s->last; d; d = d->prev)
+			delta_apply(b, d, 0);
+
+	u->applying = 0;
+
+	*y = s->first->y;
+	*x = s->first->x;
+	buffer_modified(b) = 1;
+}
+
+int undo_undo(buffer_t *b, int *y, int *x)
+{
+	struct undo *u = b->undo;
+
+	if(!u || !u->cur)
+		return 1;
+
+	undo_apply(b, u->cur, 0, y, x);
+	u->cur = u->cur->prev;
+	return 0;
+}
+
+int undo_redo(buffer_t *b, int *y, int *x)
+{
+	struct undo *u = b->undo;
+	struct step *s;
+
+	if(!u || !(s = u->cur ? u->cur->next : u->first))
+		return 1;
+
+	undo_apply(b, s, 1, y, x);
+	u->cur = s;
+	return 0;
+}
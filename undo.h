@@ -0,0 +1,36 @@
+#ifndef UNDO_H
+#define UNDO_H
+
+/*
+ * undo - every change to a buffer is kept as a delta, either
+ *   lines: nold lines from y replaced with nnew lines, or
+ *   chars: in line y, from x, nold bytes replaced with nnew bytes
+ * along with the text on both sides, so it can be applied either way
+ *
+ * deltas are grouped into steps, one per command, and the oldest steps
+ * are forgotten once they take up more than "undomem" MB
+ */
+
+struct undo;
+
+/* recording, from buffer.c - a lines delta is given a line at a time */
+void undo_lines_begin(buffer_t *, int y);
+void undo_lines_old(  buffer_t *, const char *, int len);
+void undo_lines_new(  buffer_t *, const char *, int len);
+void undo_lines_end(  buffer_t *);
+
+void undo_chars(buffer_t *, int y, int x,
+		const char *old, int nold, const char *new, int nnew);
+
+/* a line that's being changed in place, then what it became */
+void undo_line_edit(   buffer_t *, int y, const char *, int len);
+void undo_line_changed(buffer_t *, int y, const char *, int len);
+
+void undo_break(buffer_t *); /* the end of a step */
+void undo_free(struct undo *);
+
+/* 0 on success, setting *y and *x to where the change was */
+int undo_undo(buffer_t *, int *y, int *x);
+int undo_redo(buffer_t *, int *y, int *x);
+
+#endif
@@ -82,3 +82,88 @@ void ustrcat(char **p, int *siz_arg, ...)
 		strcat(*p, s);
 	va_end(l);
 }
+
+#define ARENA_MIN 4096
+#define ARENA_MAX (1024 * 1024)
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+};
+
+void *arena_alloc(struct arena *a, size_t s)
+{
+	const size_t align = sizeof(void *);
+	struct arena_chunk *c;
+	size_t pad, siz;
+	char *p;
+
+	if(s > ARENA_MAX / 4){
+		/* big - give it a chunk of its own, behind the current one */
+		c = umalloc(sizeof *c + s);
+		if(a->chunks){
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		}else{
+			c->next = NULL;
+			a->chunks = c;
+		}
+		return c + 1;
+	}
+
+	pad = a->pos ? -(size_t)a->pos & (align - 1) : 0;
+
+	if(!a->pos || (size_t)(a->end - a->pos) < pad + s){
+		if(a->chunksiz < ARENA_MIN)
+			a->chunksiz = ARENA_MIN;
+		else if(a->chunksiz < ARENA_MAX)
+			a->chunksiz *= 2;
+		siz = a->chunksiz;
+
+		c = umalloc(siz);
+		c->next = a->chunks;
+		a->chunks = c;
+
+		a->pos = (char *)(c + 1);
+		a->end = (char *)c + siz;
+		pad = 0;
+	}
+
+	p = a->pos + pad;
+	a->pos = p + s;
+	return p;
+}
+
+/* hand from's chunks over to a */
+void arena_merge(struct arena *a, struct arena *from)
+{
+	struct arena_chunk *c;
+
+	if(!(c = from->chunks))
+		return;
+
+	while(c->next)
+		c = c->next;
+
+	if(a->chunks){
+		/* behind a's current chunk, which is still being used */
+		c->next = a->chunks->next;
+		a->chunks->next = from->chunks;
+	}else{
+		a->chunks = from->chunks;
+	}
+
+	memset(from, 0, sizeof *from);
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for(c = a->chunks; c; c = next){
+		next = c->next;
+		free(c);
+	}
+
+	memset(a, 0, sizeof *a);
+}
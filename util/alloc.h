@@ -8,10 +8,32 @@ char *ustrdup2(const char *, const char *);
 void ustrcat(char **p, int *siz, ...);
 char *ustrprintf(const char *fmt, ...);
 
+/*
+ * an arena hands out memory from large chunks
+ * nothing is freed individually - arena_free() releases the lot
+ */
+struct arena
+{
+	struct arena_chunk *chunks;
+	char *pos, *end;
+	size_t chunksiz;
+};
+
+void *arena_alloc(struct arena *, size_t);
+void  arena_merge(struct arena *, struct arena *from);
+void  arena_free( struct arena *);
+
 #ifdef __GNUC__
 # define ALLOCA __builtin_alloca
 #else
 # define ALLOCA alloca
 #endif
 
+/* for refcounts dropped from other threads - evaluates to the new value */
+#ifdef __GNUC__
+# define ATOMIC_ADD(p, n) __atomic_add_fetch(p, n, __ATOMIC_ACQ_REL)
+#else
+# define ATOMIC_ADD(p, n) (*(p) += (n))
+#endif
+
 #endif
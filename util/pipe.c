@@ -14,14 +14,12 @@
 #include "../range.h"
 #include "list.h"
 #include "io.h"
-#include "pipe.h"
-#include "alloc.h"
-
-/* range_through_pipe */
 #include "../buffer.h"
 #include "../buffers.h"
+#include "pipe.h"
+#include "alloc.h"
 
-static int parent_write(int, struct list *);
+static int parent_write(int, const struct buffer_view *);
 
 #define WRITE_FD 1
 #define READ_FD 0
@@ -61,7 +59,7 @@ struct list *pipe_read(const char *cmd)
 	}
 }
 
-int pipe_write(const char *cmd, struct list *l, int close_out)
+int pipe_write(const char *cmd, const struct buffer_view *v, int close_out)
 {
 	int fds[2]; /* 0 = read, 1 = write */
 
@@ -90,14 +88,14 @@ int pipe_write(const char *cmd, struct list *l, int close_out)
 		{
 			int ret;
 			close(fds[READ_FD]);
-			parent_write(fds[WRITE_FD], l);
+			parent_write(fds[WRITE_FD], v);
 			wait(&ret);
 			return ret;
 		}
 	}
 }
 
-struct list *pipe_readwrite(const char *cmd, struct list *l)
+struct list *pipe_readwrite(const char *cmd, const struct buffer_view *v)
 {
 	int parent_to_child[2], child_to_parent[2];
 
@@ -137,7 +135,7 @@ struct list *pipe_readwrite(const char *cmd, struct list *l)
 			close(parent_to_child[READ_FD]);
 			close(child_to_parent[WRITE_FD]);
 
-			if(parent_write(parent_to_child[WRITE_FD], l))
+			if(parent_write(parent_to_child[WRITE_FD], v))
 				ret = NULL;
 			else
 				ret = list_from_fd(child_to_parent[READ_FD], NULL);
@@ -151,13 +149,14 @@ struct list *pipe_readwrite(const char *cmd, struct list *l)
 	}
 }
 
-static int parent_write(int fd, struct list *l)
+static int parent_write(int fd, const struct buffer_view *v)
 {
 	static const char nl = '\n';
-	int ret = 0;
+	struct list *l;
+	int i, ret = 0;
 
-	for(; l; l = l->next)
-		if(write(fd, l->data, strlen(l->data)) == -1 ||
+	for(i = 0, l = v->start; i < v->n; i++, l = l->next)
+		if(write(fd, l->data, buffer_line_len(l)) == -1 ||
 				write(fd, &nl, 1) == -1){
 			ret = -1;
 			break;
@@ -170,43 +169,29 @@ static int parent_write(int fd, struct list *l)
 
 int range_through_pipe(struct range *rng, const char *cmd)
 {
-	struct list *l, *to_pipe;
-	int eno, ret = 0;
-
-	to_pipe = buffer_extract_range(buffers_current(), rng);
-
-	l = pipe_readwrite(cmd, to_pipe ? to_pipe : buffer_gethead(buffers_current()));
-
-	if(l){
-		if(l->data){
-			if(to_pipe){
-				struct list *inshere;
-
-				inshere = buffer_getindex(buffers_current(), rng->start);
-
-				if(inshere)
-					buffer_insertlistbefore(buffers_current(), inshere, l);
-				else
-					buffer_appendlist(buffers_current(), l);
-
-				list_free_nodata(to_pipe);
-				to_pipe = NULL;
-			}else{
-				buffer_replace(buffers_current(), l);
-			}
-
-			buffer_modified(buffers_current()) = 1;
-		}else{
-			/* FIXME? assign to_pipe to "reg? restore into buffer? */
-			list_free(l, free);
-			ret = 1;
-		}
-	}
-
-	eno = errno;
-	if(to_pipe)
-		list_free(to_pipe, free);
-	errno = eno;
-
-	return ret;
+	buffer_t *b = buffers_current();
+	struct buffer_view v;
+	struct range r;
+	struct list *l;
+	int n, got;
+
+	/* piped from where they are, and only replaced once the command's done */
+	buffer_getview(b, rng, &v);
+	if(!v.n || !(l = pipe_readwrite(cmd, &v)))
+		return 1;
+
+	n = buffer_nlines(b);
+	if((got = !!l->data))
+		buffer_insertlistbefore(b, v.start, l);
+	else
+		list_free(l, free);
+
+	/* in first, so the buffer is never left empty */
+	r.start = rng->start + buffer_nlines(b) - n;
+	r.end   = r.start + v.n - 1;
+	buffer_remove_range(b, &r);
+
+	buffer_modified(b) = 1;
+
+	return !got;
 }
@@ -2,8 +2,9 @@
 #define PIPE_H
 
 struct list *pipe_read(const char *);
-int          pipe_write(const char *, struct list *, int close_out);
-struct list *pipe_readwrite(const char *, struct list *);
+/* the view's lines are written to cmd's stdin */
+int          pipe_write(const char *, const struct buffer_view *, int close_out);
+struct list *pipe_readwrite(const char *, const struct buffer_view *);
 int          range_through_pipe(struct range *rng, const char *cmd);
 
 #endif
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ptree.h"
+#include "alloc.h"
+#include "str.h"
+
+#define PT_CHUNK 32
+
+/*
+ * entries [0, n) of e[] come between the left subtree's and the right's
+ * a node with more than one reference is shared, so it's never changed
+ */
+struct pnode
+{
+	unsigned int refs;
+	unsigned int prio; /* kept, so a copy goes where the original was */
+	int count; /* entries in this subtree */
+	int ndirty; /* PT_DIRTY ones */
+	struct pnode *left, *right;
+	int n;
+	int edirty; /* PT_DIRTY ones in e[] */
+	struct pentry e[PT_CHUNK];
+};
+
+#define PT_COUNT(t) ((t) ? (t)->count : 0)
+#define PT_DIRTIES(t) ((t) ? (t)->ndirty : 0)
+
+static struct pnode *pt_new(void)
+{
+	struct pnode *t = umalloc(sizeof *t);
+	unsigned long long h = (unsigned long long)(size_t)t;
+
+	/* as tree.c's priorities, but only hashed once */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	t->refs = 1;
+	t->prio = h;
+	t->count = t->ndirty = t->n = t->edirty = 0;
+	t->left = t->right = NULL;
+	return t;
+}
+
+static void pt_fix(struct pnode *t)
+{
+	t->count = PT_COUNT(t->left) + t->n + PT_COUNT(t->right);
+	t->ndirty = PT_DIRTIES(t->left) + t->edirty + PT_DIRTIES(t->right);
+}
+
+static int pt_dirty(const struct pentry *e, int n)
+{
+	int i, dirty = 0;
+
+	for(i = 0; i < n; i++)
+		if(e[i].flags & PT_DIRTY)
+			dirty++;
+	return dirty;
+}
+
+static void pt_release(struct pentry *e, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+		if(e[i].flags & PT_REF)
+			str_unref((void *)e[i].s);
+}
+
+/*
+ * t, ours to change - a copy if it's shared, which takes the place of
+ * the reference to t that the caller had
+ */
+static struct pnode *pt_own(struct pnode *t)
+{
+	struct pnode *u;
+	int i;
+
+	/* only the one thread changing t can add to refs - others only drop theirs */
+	if(t->refs == 1)
+		return t;
+
+	u = umalloc(sizeof *u);
+	memcpy(u, t, sizeof *u);
+	u->refs = 1;
+
+	ptree_ref(u->left);
+	ptree_ref(u->right);
+	for(i = 0; i < u->n; i++)
+		if(u->e[i].flags & PT_REF)
+			str_ref((char *)u->e[i].s);
+
+	ptree_unref(t);
+	return u;
+}
+
+struct pnode *ptree_ref(struct pnode *t)
+{
+	if(t)
+		ATOMIC_ADD(&t->refs, 1);
+	return t;
+}
+
+void ptree_unref(struct pnode *t)
+{
+	if(t && !ATOMIC_ADD(&t->refs, -1)){
+		pt_release(t->e, t->n);
+		ptree_unref(t->left);
+		ptree_unref(t->right);
+		free(t);
+	}
+}
+
+int ptree_count(const struct pnode *t)
+{
+	return PT_COUNT(t);
+}
+
+const struct pentry *ptree_index(const struct pnode *t, int i)
+{
+	while(t){
+		const int nleft = PT_COUNT(t->left);
+
+		if(i < nleft){
+			t = t->left;
+		}else if(i < nleft + t->n){
+			return &t->e[i - nleft];
+		}else{
+			i -= nleft + t->n;
+			t = t->right;
+		}
+	}
+
+	return NULL;
+}
+
+static struct pnode *pt_merge(struct pnode *a, struct pnode *b)
+{
+	if(!a)
+		return b;
+	if(!b)
+		return a;
+
+	if(a->prio > b->prio){
+		a = pt_own(a);
+		a->right = pt_merge(a->right, b);
+		pt_fix(a);
+		return a;
+	}
+
+	b = pt_own(b);
+	b->left = pt_merge(a, b->left);
+	pt_fix(b);
+	return b;
+}
+
+/* the first i entries go to *l, the rest to *r - a chunk they're both in is cut in two */
+static void pt_split(struct pnode *t, int i, struct pnode **l, struct pnode **r)
+{
+	int nleft;
+
+	/* what's left whole is left shared */
+	if(i <= 0){
+		*l = NULL;
+		*r = t;
+		return;
+	}
+	if(i >= PT_COUNT(t)){
+		*l = t;
+		*r = NULL;
+		return;
+	}
+
+	t = pt_own(t);
+	nleft = PT_COUNT(t->left);
+
+	if(i <= nleft){
+		pt_split(t->left, i, l, &t->left);
+		pt_fix(t);
+		*r = t;
+	}else if(i >= nleft + t->n){
+		pt_split(t->right, i - nleft - t->n, &t->right, r);
+		pt_fix(t);
+		*l = t;
+	}else{
+		struct pnode *u = pt_new();
+		const int k = i - nleft;
+
+		u->prio = t->prio;
+		u->n = t->n - k;
+		memcpy(u->e, t->e + k, u->n * sizeof *u->e);
+		u->edirty = pt_dirty(u->e, u->n);
+		u->right = t->right;
+		t->right = NULL;
+		t->n = k;
+		t->edirty -= u->edirty;
+
+		pt_fix(t);
+		pt_fix(u);
+		*l = t;
+		*r = u;
+	}
+}
+
+static struct pnode *pt_build(const struct pentry *e, int n)
+{
+	struct pnode *root = NULL;
+
+	while(n > 0){
+		struct pnode *t = pt_new();
+
+		t->n = n < PT_CHUNK ? n : PT_CHUNK;
+		memcpy(t->e, e, t->n * sizeof *e);
+		t->edirty = pt_dirty(e, t->n);
+		pt_fix(t);
+
+		root = pt_merge(root, t);
+		e += t->n;
+		n -= t->n;
+	}
+
+	return root;
+}
+
+/*
+ * whether [i, i + nold) is in one chunk, with room for nnew in its place
+ * - most changes are, and making them there leaves the chunks as they are
+ */
+static int pt_fits(const struct pnode *t, int i, int nold, int nnew)
+{
+	while(t){
+		const int nleft = PT_COUNT(t->left);
+
+		if(i < nleft){
+			if(i + nold > nleft)
+				return 0;
+			t = t->left;
+		}else if(i - nleft < t->n || (i - nleft == t->n && !nold)){
+			i -= nleft;
+			return i + nold <= t->n && t->n - nold + nnew <= PT_CHUNK;
+		}else{
+			i -= nleft + t->n;
+			t = t->right;
+		}
+	}
+
+	return 0;
+}
+
+/* ptree_splice(), once pt_fits() says so - the same way down */
+static struct pnode *pt_edit(struct pnode *t, int i, int nold, const struct pentry *new, int nnew)
+{
+	int nleft;
+
+	t = pt_own(t);
+	nleft = PT_COUNT(t->left);
+
+	if(i < nleft){
+		t->left = pt_edit(t->left, i, nold, new, nnew);
+	}else if(i - nleft < t->n || (i - nleft == t->n && !nold)){
+		const int k = i - nleft;
+
+		pt_release(t->e + k, nold);
+		t->edirty -= pt_dirty(t->e + k, nold);
+		memmove(t->e + k + nnew, t->e + k + nold, (t->n - k - nold) * sizeof *t->e);
+		if(nnew)
+			memcpy(t->e + k, new, nnew * sizeof *t->e);
+		t->edirty += pt_dirty(new, nnew);
+
+		if(!(t->n += nnew - nold)){
+			struct pnode *sub = pt_merge(t->left, t->right);
+
+			free(t);
+			return sub;
+		}
+	}else{
+		t->right = pt_edit(t->right, i - nleft - t->n, nold, new, nnew);
+	}
+
+	pt_fix(t);
+	return t;
+}
+
+void ptree_splice(struct pnode **root, int i, int nold, const struct pentry *new, int nnew)
+{
+	struct pnode *l, *mid, *r;
+
+	if(!nold && !nnew)
+		return;
+
+	if(pt_fits(*root, i, nold, nnew)){
+		*root = pt_edit(*root, i, nold, new, nnew);
+		return;
+	}
+
+	pt_split(*root, i, &l, &mid);
+	pt_split(mid, nold, &mid, &r);
+	ptree_unref(mid);
+
+	*root = pt_merge(pt_merge(l, pt_build(new, nnew)), r);
+}
+
+void ptree_resolve(struct pnode **root, void fn(struct pentry *, void *), void *ctx)
+{
+	struct pnode *t = *root;
+	int i;
+
+	if(!t || !t->ndirty)
+		return;
+
+	t = *root = pt_own(t);
+
+	ptree_resolve(&t->left, fn, ctx);
+	for(i = 0; t->edirty && i < t->n; i++)
+		if(t->e[i].flags & PT_DIRTY){
+			fn(&t->e[i], ctx);
+			t->edirty--;
+		}
+	ptree_resolve(&t->right, fn, ctx);
+
+	pt_fix(t);
+}
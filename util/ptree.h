@@ -0,0 +1,40 @@
+#ifndef PTREE_H
+#define PTREE_H
+
+/*
+ * a persistent list of strings - an order-statistic treap of chunks of
+ * entries, whose versions share nodes. a version is a root, with a
+ * reference: changing one copies whatever nodes on the way down are
+ * shared (path copying), so other versions never see the change.
+ * only one thread may change a version, but any can read or drop one
+ */
+struct pentry
+{
+	const char *s;
+	int len;
+	int flags;
+};
+
+/*
+ * PT_REF: s is a str_share()d reference, dropped with the entry
+ * PT_DIRTY: s is the owner's, until ptree_resolve() replaces the entry -
+ * the owner resolves a version before sharing it
+ */
+#define PT_REF   1
+#define PT_DIRTY 2
+
+struct pnode;
+
+struct pnode *ptree_ref(  struct pnode *);
+void          ptree_unref(struct pnode *);
+
+int                  ptree_count(const struct pnode *);
+const struct pentry *ptree_index(const struct pnode *, int i);
+
+/* entries [i, i + nold) are replaced by new[], which are taken over, references and all */
+void ptree_splice(struct pnode **root, int i, int nold, const struct pentry *new, int nnew);
+
+/* fn() replaces each PT_DIRTY entry, which costs nothing if there are none */
+void ptree_resolve(struct pnode **root, void fn(struct pentry *, void *), void *ctx);
+
+#endif
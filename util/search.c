@@ -5,15 +5,252 @@
 
 #include "search.h"
 #include "alloc.h"
+#include "../main.h"
 #include "../global.h"
 #include "../util/str.h"
+#include "../regex/regex.h"
+
+/*
+ * compiled patterns are kept, most recently used first, so a redraw or
+ * an n doesn't compile the pattern all over again. an entry is freed
+ * once it's out of the cache and no usearch has it
+ */
+#define USEARCH_CACHE 8
+
+struct usearch_re
+{
+	regex_t reg;
+	struct regex *native; /* used instead of reg, if it could be made */
+	char *term;
+	int cflags, nativere;
+	unsigned int refs; /* the cache's, and each usearch's */
+
+	/* most patterns are just a string - then this is it, with no reg */
+	char *lit; /* folded, if REG_ICASE */
+	int litlen;
+
+	/* otherwise, a string every match has in it, if there is one */
+	char *must; /* folded too */
+	int mustlen;
+};
+
+static const char usearch_meta[] = "\\^$.[]()*+?{}|";
+
+static struct usearch_re *usearch_cache[USEARCH_CACHE];
+
+/* tolower(), as a table, so case-insensitive literals are quick to compare */
+static unsigned char usearch_fold[256];
+static int usearch_folded;
+
+static void usearch_unref(struct usearch_re *re)
+{
+	if(re && !--re->refs){
+		if(re->lit)
+			free(re->lit);
+		else if(re->native)
+			regex_free(re->native);
+		else
+			regfree(&re->reg);
+		free(re->must);
+		free(re->term);
+		free(re);
+	}
+}
+
+/* needle with its escapes taken out, if it has nothing else special - otherwise NULL */
+static char *usearch_literal(const char *needle, int ic, int *plen)
+{
+	char *lit, *p;
+
+	p = lit = umalloc(strlen(needle) + 1);
+
+	for(; *needle; needle++){
+		if(*needle == '\\' && needle[1] && strchr(usearch_meta, needle[1])){
+			needle++;
+		}else if(strchr(usearch_meta, *needle)){
+			free(lit);
+			return NULL;
+		}
+		*p++ = ic ? usearch_fold[(unsigned char)*needle] : *needle;
+	}
+	*p = '\0';
+
+	*plen = p - lit;
+	return lit;
+}
+
+/* the ']' ending the bracket expression at p, or NULL */
+static const char *usearch_bracket(const char *p)
+{
+	if(*++p == '^')
+		p++;
+	if(*p == ']')
+		p++;
+
+	for(; *p; p++){
+		if(*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')){
+			const char close[] = { p[1], ']', '\0' };
+
+			if(!(p = strstr(p + 2, close)))
+				return NULL;
+			p++;
+		}else if(*p == ']'){
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * the longest string that every match of the ERE pat has in it, or
+ * NULL. only plain characters in sequence at the top level count -
+ * groups, brackets, '.' and optional characters break them up, and
+ * anything not understood (or a top level '|') gives up
+ */
+static char *usearch_required(const char *pat, int ic, int *plen)
+{
+	char *best = NULL, *run = umalloc(strlen(pat) + 1);
+	int nbest = 0, nrun = 0, depth = 0, prevlit = 0;
+	const char *p;
+
+	for(p = pat; ; p++){
+		int c = -1; /* a plain character, to add to the run */
+
+		switch(*p){
+			case '\0':
+				break;
+
+			case '\\':
+				if(!p[1])
+					goto unknown;
+				if(strchr(usearch_meta, *++p))
+					c = *p;
+				/* else \<, \w and the like */
+				break;
+
+			case '[':
+				if(!(p = usearch_bracket(p)))
+					goto unknown;
+				break;
+
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if(!depth--)
+					goto unknown;
+				break;
+			case '|':
+				if(!depth)
+					goto unknown;
+				break;
+
+			case '{':
+			case '*':
+			case '?':
+			case '+':
+			{
+				int optional = 0;
+
+				/* as many as there are - "a+*" is as optional as "a*" */
+				for(; *p && strchr("{*?+", *p); p++){
+					if(*p == '{' && !(p = strchr(p, '}')))
+						goto unknown;
+					if(*p != '+')
+						optional = 1;
+				}
+				p--;
+
+				/* if only '+', what was before is needed, but the run ends there */
+				if(optional && prevlit)
+					nrun--;
+				break;
+			}
+
+			case '^':
+			case '$':
+			case '.':
+				break;
+
+			default:
+				c = *p;
+		}
+
+		if(c != -1 && !depth){
+			run[nrun++] = ic ? usearch_fold[(unsigned char)c] : c;
+			prevlit = 1;
+			continue;
+		}
+
+		if(nrun > nbest){
+			free(best);
+			best = umalloc(nrun + 1);
+			memcpy(best, run, nrun);
+			best[nbest = nrun] = '\0';
+		}
+		nrun = prevlit = 0;
+
+		if(!*p)
+			break;
+	}
+
+	free(run);
+	*plen = nbest;
+	return best;
+
+unknown:
+	free(run);
+	free(best);
+	return NULL;
+}
+
+/*
+ * the first of lit in s[at, len). memmem() and memchr() do the
+ * scanning, a word or more at a time, which is what makes it quick
+ */
+static const char *usearch_findstr(const char *lit, int litlen, int ic,
+		const char *s, int at, int len)
+{
+	const char *p = s + at, *end, *lower = NULL, *upper = NULL;
+	int lc, uc;
+
+	if(len - at < litlen)
+		return NULL;
+	if(!ic || !litlen)
+		return memmem(p, len - at, lit, litlen);
+
+	/* candidates are where either case of the first byte is */
+	end = s + len - litlen + 1;
+	lc = (unsigned char)*lit;
+	uc = toupper(lc);
+
+	for(;;){
+		int i;
+
+		if(!lower || lower < p)
+			if(!(lower = memchr(p, lc, end - p)))
+				lower = end;
+		if(!upper || upper < p)
+			if(uc == lc || !(upper = memchr(p, uc, end - p)))
+				upper = end;
+
+		if((p = lower < upper ? lower : upper) == end)
+			return NULL;
+
+		for(i = 1; i < litlen; i++)
+			if(usearch_fold[(unsigned char)p[i]] != (unsigned char)lit[i])
+				break;
+		if(i == litlen)
+			return p;
+		p++;
+	}
+}
 
 int usearch_init(struct usearch *us, const char *needle)
 {
-	regex_t *r;
-	int ic = 0;
+	struct usearch_re *re;
+	int ic = 0, cflags, i;
 
-	r = umalloc(sizeof *r);
 	memset(us, 0, sizeof *us);
 
 	if(global_settings.ignorecase)
@@ -21,14 +258,53 @@ int usearch_init(struct usearch *us, const char *needle)
 	else if(global_settings.smartcase)
 		ic = !str_mixed_case(needle);
 
-	if((us->lastret = regcomp(r, needle, REG_EXTENDED | (ic ? REG_ICASE : 0)))){
-		/* r still needs to be free'd */
-		free(r);
-		return 1;
+	cflags = REG_EXTENDED | (ic ? REG_ICASE : 0);
+
+	if(ic && !usearch_folded){
+		for(i = 0; i < 256; i++)
+			usearch_fold[i] = tolower(i);
+		usearch_folded = 1;
+	}
+
+	for(i = 0; i < USEARCH_CACHE && usearch_cache[i]; i++)
+		if(usearch_cache[i]->cflags == cflags && !strcmp(usearch_cache[i]->term, needle)
+		&& usearch_cache[i]->nativere == global_settings.nativere)
+			break;
+
+	if(i < USEARCH_CACHE && usearch_cache[i]){
+		re = usearch_cache[i];
+	}else{
+		re = umalloc(sizeof *re);
+		memset(re, 0, sizeof *re);
+
+		/* regcomp() is left what regex_create() can't do, and to report errors */
+		if(!(re->lit = usearch_literal(needle, ic, &re->litlen))
+		&& !(global_settings.nativere && (re->native = regex_create(needle, ic ? REGEX_ICASE : 0)))
+		&& (us->lastret = regcomp(&re->reg, needle, cflags))){
+			/* re->reg still needs to be free'd */
+			free(re);
+			return 1;
+		}
+
+		if(!re->lit)
+			re->must = usearch_required(needle, ic, &re->mustlen);
+
+		re->term = ustrdup(needle);
+		re->cflags = cflags;
+		re->nativere = global_settings.nativere;
+		re->refs = 1;
+
+		/* the least recently used goes */
+		i = USEARCH_CACHE - 1;
+		usearch_unref(usearch_cache[i]);
 	}
 
-	us->reg = r;
-	us->term = ustrdup(needle);
+	memmove(&usearch_cache[1], &usearch_cache[0], i * sizeof *usearch_cache);
+	usearch_cache[0] = re;
+
+	re->refs++;
+	us->re = re;
+	us->term = re->term;
 
 	return 0;
 }
@@ -37,81 +313,107 @@ const char *usearch_err(struct usearch *us)
 {
 	int len;
 
-	len = regerror(us->lastret, us->reg, NULL, 0);
+	len = regerror(us->lastret, us->re ? &us->re->reg : NULL, NULL, 0);
 
 	if(us->ebuf)
 		free(us->ebuf);
 	us->ebuf = umalloc(len);
 
-	regerror(us->lastret, us->reg, us->ebuf, len);
+	regerror(us->lastret, us->re ? &us->re->reg : NULL, us->ebuf, len);
 
 	return us->ebuf;
 }
 
-const char *usearch(struct usearch *us, const char *parliment, int offset)
+/*
+ * the first match in s[at, len) - what's before at is still there for
+ * ^ and \< to see, so it isn't taken as the start of the line. it only
+ * has to be found if it starts at or before to, so where possible the
+ * search goes no further
+ */
+static int usearch_exec(struct usearch *us, const char *s, int at, int to, int len, regmatch_t *m)
+{
+	const struct usearch_re *re = us->re;
+	const int ic = re->cflags & REG_ICASE;
+
+	if(re->lit){
+		const char *p = usearch_findstr(re->lit, re->litlen, ic, s, at,
+				to < len - re->litlen ? to + re->litlen : len);
+
+		if(!p)
+			return us->lastret = REG_NOMATCH;
+		m->rm_so = p - s;
+		m->rm_eo = m->rm_so + re->litlen;
+		return us->lastret = 0;
+	}
+
+	/* a match would have to be within s[at, len), so it can't be if must isn't */
+	if(re->must && !usearch_findstr(re->must, re->mustlen, ic, s, at, len))
+		return us->lastret = REG_NOMATCH;
+
+	if(re->native){
+		int start, end, ret;
+
+		if((ret = regex_matches_before(re->native, s, at, to, len, &start, &end)) == -1)
+			die("regex_matches_before()");
+		if(!ret)
+			return us->lastret = REG_NOMATCH;
+		m->rm_so = start;
+		m->rm_eo = end;
+		return us->lastret = 0;
+	}
+
+#ifdef REG_STARTEND
+	m->rm_so = at;
+	m->rm_eo = len;
+	return us->lastret = regexec(&us->re->reg, s, 1, m, REG_STARTEND);
+#else
+	(void)len;
+	if((us->lastret = regexec(&us->re->reg, s + at, 1, m, at ? REG_NOTBOL : 0)))
+		return us->lastret;
+	m->rm_so += at;
+	m->rm_eo += at;
+	return 0;
+#endif
+}
+
+const char *usearch(struct usearch *us, const char *parliment, int len, int offset)
 {
 	regmatch_t match;
 
-	if((us->lastret = regexec(us->reg, parliment + offset, 1 /* 1 match */, &match, 0))){
+	if(offset > len || usearch_exec(us, parliment, offset, len, len, &match)){
 		/* no match */
 		return NULL;
 	}else{
 		us->first_match_len = match.rm_eo - match.rm_so;
-		return parliment + offset + match.rm_so;
+		return parliment + match.rm_so;
 	}
 }
 
-const char *usearch_rev(struct usearch *us, const char *parliment, int offset)
+/*
+ * the last match starting at or before offset - one pass along the
+ * line, each search starting where the last match ended, as for n
+ */
+const char *usearch_rev(struct usearch *us, const char *parliment, int len, int offset)
 {
-	const char *ret, *lastmatch;
-	char *dup;
-	int curoffset, term_len;
-
-	dup = umalloc(strlen(parliment) + 2);
-	strcpy(dup, parliment);
-	dup[offset + 1] = '\0';
-	lastmatch = NULL;
-
-	term_len = strlen(us->term);
-
-	if(offset < 0) offset = 0;
-
-	/* start at the middle, and binary jump until we find the last match, up to offset */
-	curoffset = offset / 2;
-
-	for(; curoffset < (signed)strlen(dup);){
-		if((ret = usearch(us, dup + curoffset, 0))){
-			lastmatch = ret;
-
-			/* jump further along and look for a match again */
-			/* strlen could be optimised out here */
-			curoffset += term_len;
-
-		}else if(lastmatch){
-			int o = lastmatch - dup;
-
-			free(dup);
-			return parliment + o; /* couldn't find one closer, return this */
+	const char *last = NULL;
+	regmatch_t match;
+	int at = 0;
 
-		}else{
-			/* if we're here then either we have never found a match, step back */
-			if(curoffset <= 0)
-				break;
+	while(at <= offset && at <= len
+	&& !usearch_exec(us, parliment, at, offset, len, &match)
+	&& match.rm_so <= offset){
+		last = parliment + match.rm_so;
+		us->first_match_len = match.rm_eo - match.rm_so;
 
-			curoffset -= term_len + 1;
-			if(curoffset < 0) curoffset = 0;
-		}
+		/* an empty match would be found again */
+		at = match.rm_eo > match.rm_so ? match.rm_eo : match.rm_so + 1;
 	}
 
-	free(dup);
-	return NULL;
+	return last;
 }
 
 void usearch_free(struct usearch *us)
 {
-	if(us->reg)
-		regfree((regex_t *)us->reg);
+	usearch_unref(us->re);
 	free(us->ebuf);
-	free(us->reg);
-	free(us->term);
 }
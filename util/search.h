@@ -3,19 +3,19 @@
 
 struct usearch
 {
-	void *reg;
+	struct usearch_re *re; /* compiled, and shared through a cache */
 
 	int lastret;
 
 	char *ebuf;
-	char *term;
+	const char *term;
 
 	int first_match_len;
 };
 
 int         usearch_init(struct usearch *, const char *honest_man);
-const char *usearch(     struct usearch *, const char *parliment, int offset);
-const char *usearch_rev( struct usearch *, const char *parliment, int offset);
+const char *usearch(     struct usearch *, const char *parliment, int len, int offset);
+const char *usearch_rev( struct usearch *, const char *parliment, int len, int offset);
 const char *usearch_err( struct usearch *);
 void        usearch_free(struct usearch *);
 
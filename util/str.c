@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -210,6 +211,60 @@ char *str_expand(char *str, const char *grow_from, const char *grow_to)
 	return str;
 }
 
+unsigned long long str_hash(unsigned long long h, const char *s, size_t n)
+{
+	while(n--){
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+struct str_shared
+{
+	unsigned int refs;
+	unsigned int len;
+	char s[];
+};
+
+#define SHARED(s) ((struct str_shared *)((char *)(s) - offsetof(struct str_shared, s)))
+
+/* malloc()'s bookkeeping is taken to be a word a chunk, and chunks two words aligned */
+size_t str_share_size(size_t n)
+{
+	const size_t align = 2 * sizeof(size_t);
+
+	return (sizeof(struct str_shared) + n + 1 + sizeof(size_t) + align - 1) / align * align;
+}
+
+char *str_share(const char *s, size_t n)
+{
+	struct str_shared *sh = umalloc(sizeof *sh + n + 1);
+
+	sh->refs = 1;
+	sh->len = n;
+	memcpy(sh->s, s, n);
+	sh->s[n] = '\0';
+	return sh->s;
+}
+
+size_t str_share_len(const char *s)
+{
+	return SHARED(s)->len;
+}
+
+char *str_ref(char *s)
+{
+	ATOMIC_ADD(&SHARED(s)->refs, 1);
+	return s;
+}
+
+void str_unref(void *s)
+{
+	if(s && !ATOMIC_ADD(&SHARED(s)->refs, -1))
+		free(SHARED(s));
+}
+
 int str_numeric(const char *s)
 {
 	if(!*s)
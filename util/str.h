@@ -24,6 +24,21 @@ void  str_insert(char **store, int *store_size, int *store_idx, const char *inse
 
 int  str_mixed_case(const char *);
 
+/* FNV-1a, h being STR_HASH_INIT to start with, or the hash so far */
+#define STR_HASH_INIT 0xcbf29ce484222325ULL
+unsigned long long str_hash(unsigned long long h, const char *, size_t);
+
+/*
+ * refcounted strings, which nothing may change - a copy of n bytes,
+ * another reference, and dropping one (freeing it with the last)
+ * references can be taken and dropped from any thread
+ */
+char  *str_share(const char *, size_t n);
+size_t str_share_len(const char *); /* n - there may be '\0's before it */
+size_t str_share_size(size_t n); /* what str_share() of n takes from malloc(), overhead and all */
+char  *str_ref(  char *);
+void   str_unref(void *);
+
 char *str_home_replace(char *);
 void  str_home_replace_array(int, char **);
 
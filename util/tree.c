@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../range.h"
+#include "list.h"
+#include "tree.h"
+#include "alloc.h"
+
+/*
+ * priorities are a hash of the node's address,
+ * which saves storing (and seeding) a random number per node
+ */
+static unsigned int tree_prio(const struct tnode *t)
+{
+	unsigned long long h = (unsigned long long)(size_t)t;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void tree_fix(struct tnode *t)
+{
+	t->count = 1 + tree_count(t->left) + tree_count(t->right);
+	if(t->left)
+		t->left->parent = t;
+	if(t->right)
+		t->right->parent = t;
+}
+
+static struct tnode *tree_merge(struct tnode *a, struct tnode *b)
+{
+	if(!a)
+		return b;
+	if(!b)
+		return a;
+
+	if(tree_prio(a) > tree_prio(b)){
+		a->right = tree_merge(a->right, b);
+		tree_fix(a);
+		return a;
+	}
+
+	b->left = tree_merge(a, b->left);
+	tree_fix(b);
+	return b;
+}
+
+/* the first i nodes go to *l, the rest to *r */
+static void tree_split(struct tnode *t, int i, struct tnode **l, struct tnode **r)
+{
+	if(!t){
+		*l = *r = NULL;
+		return;
+	}
+
+	if(tree_count(t->left) < i){
+		tree_split(t->right, i - tree_count(t->left) - 1, &t->right, r);
+		tree_fix(t);
+		*l = t;
+	}else{
+		tree_split(t->left, i, l, &t->left);
+		tree_fix(t);
+		*r = t;
+	}
+}
+
+/* cartesian tree construction - O(n), since the chain is already in order */
+static struct tnode *tree_build(struct tnode *chain)
+{
+	struct tnode **stack, *last, *t;
+	int sp = 0, size = 32;
+
+	stack = umalloc(size * sizeof *stack);
+
+	for(t = chain; t; t = (struct tnode *)t->l.next){
+		last = NULL;
+		while(sp && tree_prio(stack[sp - 1]) < tree_prio(t)){
+			last = stack[--sp];
+			tree_fix(last);
+		}
+
+		t->left  = last;
+		t->right = NULL;
+		if(sp)
+			stack[sp - 1]->right = t;
+
+		if(sp == size)
+			stack = urealloc(stack, (size *= 2) * sizeof *stack);
+		stack[sp++] = t;
+	}
+
+	last = NULL;
+	while(sp){
+		last = stack[--sp];
+		tree_fix(last);
+	}
+
+	free(stack);
+
+	if(last)
+		last->parent = NULL;
+	return last;
+}
+
+struct tnode *tree_index(struct tnode *t, int i)
+{
+	while(t){
+		const int nleft = tree_count(t->left);
+
+		if(i < nleft){
+			t = t->left;
+		}else if(i == nleft){
+			return t;
+		}else{
+			i -= nleft + 1;
+			t = t->right;
+		}
+	}
+
+	return NULL;
+}
+
+int tree_rank(struct tnode *t)
+{
+	int i = tree_count(t->left);
+
+	for(; t->parent; t = t->parent)
+		if(t == t->parent->right)
+			i += tree_count(t->parent->left) + 1;
+
+	return i;
+}
+
+struct tnode *tree_first(struct tnode *t)
+{
+	if(t)
+		while(t->left)
+			t = t->left;
+	return t;
+}
+
+struct tnode *tree_last(struct tnode *t)
+{
+	if(t)
+		while(t->right)
+			t = t->right;
+	return t;
+}
+
+void tree_insert(struct tnode **root, int i, struct tnode *chain)
+{
+	struct tnode *prev, *next, *end, *sub, *l, *r;
+
+	if(!chain)
+		return;
+
+	prev = i > 0 ? tree_index(*root, i - 1) : NULL;
+	next = tree_index(*root, i);
+
+	sub = tree_build(chain);
+
+	for(end = chain; end->l.next; end = (struct tnode *)end->l.next)
+		end->l.next->prev = &end->l;
+
+	if((chain->l.prev = prev ? &prev->l : NULL))
+		prev->l.next = &chain->l;
+	if((end->l.next = next ? &next->l : NULL))
+		next->l.prev = &end->l;
+
+	tree_split(*root, i, &l, &r);
+	*root = tree_merge(tree_merge(l, sub), r);
+	(*root)->parent = NULL;
+}
+
+struct tnode *tree_extract(struct tnode **root, int i, int n)
+{
+	struct tnode *l, *mid, *r, *first, *last;
+
+	if(i < 0 || n <= 0 || i >= tree_count(*root))
+		return NULL;
+
+	tree_split(*root, i, &l, &mid);
+	tree_split(mid, n, &mid, &r);
+
+	first = tree_first(mid);
+	last  = tree_last(mid);
+
+	if(first->l.prev)
+		first->l.prev->next = last->l.next;
+	if(last->l.next)
+		last->l.next->prev = first->l.prev;
+	first->l.prev = last->l.next = NULL;
+
+	if((*root = tree_merge(l, r)))
+		(*root)->parent = NULL;
+
+	return first;
+}
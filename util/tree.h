@@ -0,0 +1,31 @@
+#ifndef TREE_H
+#define TREE_H
+
+/*
+ * an order-statistic treap, threaded through struct list
+ * the nodes are still a plain list (->next, ->prev),
+ * but indexing and rank lookups are O(log n)
+ */
+struct tnode
+{
+	struct list l; /* must be first */
+	struct tnode *parent, *left, *right;
+	int count; /* nodes in this subtree, inclusive */
+};
+
+#define tree_count(t) ((t) ? (t)->count : 0)
+
+struct tnode *tree_index(struct tnode *root, int);
+int           tree_rank( struct tnode *);
+
+struct tnode *tree_first(struct tnode *root);
+struct tnode *tree_last( struct tnode *root);
+
+/*
+ * tree_insert links a chain of nodes (joined by ->l.next) in at index i
+ * tree_extract unlinks n nodes from index i, returning them as a chain
+ */
+void          tree_insert( struct tnode **root, int i, struct tnode *chain);
+struct tnode *tree_extract(struct tnode **root, int i, int n);
+
+#endif
@@ -39,6 +39,7 @@ static struct
 
 	[VARS_ICASE]           = { "ic",         "ignore case (search)",        1, 1, 1, &global_settings.ignorecase },
 	[VARS_SCASE]           = { "scs",        "smart case (search)",         1, 1, 1, &global_settings.smartcase },
+	[VARS_NATIVERE]        = { "nativere",   "uvi's own regex engine (search)", 1, 1, 1, &global_settings.nativere },
 
 	[VARS_HIGHLIGHT]       = { "hls",        "highlight search terms",      1, 1, 1, &global_settings.hls },
 	[VARS_SYNTAX]          = { "syn",        "syntax highlighting",         1, 1, 1, &global_settings.syn },
@@ -51,6 +52,14 @@ static struct
 
 	[VARS_FSYNC]           = { "fsync",      "call fsync() after write()",  0, 1, 1, &global_settings.fsync },
 	[VARS_ESCTRIM]         = { "esctrim",    "trim lines on escape press",  0, 1, 1, &global_settings.esctrim },
+	[VARS_LAZY]            = { "lazy",       "load files of this many MB lazily", 64, 0, 1, &global_settings.lazy },
+	[VARS_INDEX]           = { "index",      "keep line indexes of files of this many MB", 0, 0, 1, &global_settings.index },
+	[VARS_UNDOMEM]         = { "undomem",    "MB of changes to keep for undo", 32, 0, 1, &global_settings.undomem },
+	[VARS_JOURNAL]         = { "journal",    "journal writes, for :earlier", 0, 1, 1, &global_settings.journal },
+	[VARS_RECOVER]         = { "recover",    "log changes for uvi -r, after this many ms idle", 1000, 0, 1, &global_settings.recover },
+	[VARS_BUFMEM]          = { "bufmem",     "MB of other files to keep in memory", 64, 0, 1, &global_settings.bufmem },
+	[VARS_READAHEAD]       = { "readahead",  "files after the current one to read while idle", 2, 0, 1, &global_settings.readahead },
+	[VARS_INTERN]          = { "intern",     "share identical lines of files read", 0, 1, 1, &global_settings.intern },
 
 	[VARS_UVI_INFO]        = { "info",       "read ~/.uviinfo",             1, 1, 1, &global_settings.read_info },
 };
@@ -135,7 +144,12 @@ enum vartype vars_gettype(const char *s)
 
 void vars_show(enum vartype t)
 {
-	if(vars_isbool(t)){
+	if(t == VARS_INTERN && buffers_current()->interned){
+		const long saved = buffers_current()->interned;
+		char buf[32];
+		snprintf(buf, sizeof buf, " (%ldK %s)", (saved < 0 ? -saved : saved) / 1024, saved < 0 ? "more" : "saved");
+		gui_status_add_col(vars_get(t, buffers_current()) ? "" : "no", GUI_COL_RED, vars_tostring(t), GUI_NONE, buf, GUI_NONE, NULL);
+	}else if(vars_isbool(t)){
 		gui_status_add_col(vars_get(t, buffers_current()) ? "" : "no", GUI_COL_RED, vars_tostring(t), GUI_NONE, NULL);
 	}else{
 		char buf[8];
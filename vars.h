@@ -18,6 +18,7 @@ enum vartype
 
 	VARS_ICASE,
 	VARS_SCASE,
+	VARS_NATIVERE,
 
 	VARS_HIGHLIGHT,
 	VARS_SYNTAX,
@@ -30,6 +31,14 @@ enum vartype
 
 	VARS_FSYNC,
 	VARS_ESCTRIM,
+	VARS_LAZY,
+	VARS_INDEX,
+	VARS_UNDOMEM,
+	VARS_JOURNAL,
+	VARS_RECOVER,
+	VARS_BUFMEM,
+	VARS_READAHEAD,
+	VARS_INTERN,
 
 	VARS_UVI_INFO,
 
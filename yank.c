@@ -4,6 +4,7 @@
 #include "util/alloc.h"
 #include "range.h"
 #include "util/list.h"
+#include "util/str.h"
 #include "yank.h"
 
 static struct yank yanks[1 + YANK_CHAR_LAST - YANK_CHAR_FIRST]; /* named regs + default */
@@ -32,7 +33,7 @@ static void yank_set(char reg, void *d, int is_l)
 
 	if(yanks[i].v){
 		if(yanks[i].is_list)
-			list_free((struct list *)yanks[i].v, free);
+			list_free((struct list *)yanks[i].v, str_unref);
 		else
 			free(yanks[i].v);
 	}
@@ -3,7 +3,7 @@
 
 struct yank
 {
-	void *v;
+	void *v; /* a string, or a list of str_share()d lines */
 	int is_list;
 };
 